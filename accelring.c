@@ -0,0 +1,53 @@
+#include "accelring.h"
+#include <stdlib.h>
+
+// samples are dropped instead of wrapping the 32 bit offset (~24 days)
+#define ACCELRING_MAX_OFFSET_MS 0x7fffffffULL
+
+int accelRing_init(accelRing_t *r, int size) {
+	if (size < 1) return -1;
+	r->samples = calloc(size, sizeof(accelSample_t));
+	if (!r->samples) return -1;
+	r->size = size;
+	r->first = r->count = 0;
+	r->baseMs = 0;
+	return 0;
+}
+
+void accelRing_free(accelRing_t *r) {
+	free(r->samples);
+	r->samples = NULL;
+	r->size = r->count = 0;
+}
+
+void accelRing_add(accelRing_t *r, uint64_t nowMs, int16_t x, int16_t y, int16_t z) {
+	accelSample_t *s;
+
+	if (r->count && (nowMs < r->baseMs || nowMs - r->baseMs > ACCELRING_MAX_OFFSET_MS)) {
+		// clock stepped back or samples not exported for a long time
+		r->numOverwritten += r->count;
+		accelRing_clear(r);
+	}
+	if (!r->count) r->baseMs = nowMs;
+	if (r->count == r->size) {
+		r->first = (r->first + 1) % r->size;
+		r->count--;
+		r->numOverwritten++;
+	}
+	s = &r->samples[(r->first + r->count) % r->size];
+	s->offsetMs = nowMs - r->baseMs;
+	s->x = x;
+	s->y = y;
+	s->z = z;
+	r->count++;
+	r->numAdded++;
+}
+
+uint64_t accelRing_get(const accelRing_t *r, int i, accelSample_t *s) {
+	*s = r->samples[(r->first + i) % r->size];
+	return r->baseMs + s->offsetMs;
+}
+
+void accelRing_clear(accelRing_t *r) {
+	r->first = r->count = 0;
+}
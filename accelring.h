@@ -0,0 +1,45 @@
+#ifndef ACCELRING_H_INCLUDED
+#define ACCELRING_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/*
+  Fixed size ring of acceleration samples (mG as received) per device.
+  Timestamps are stored as 32 bit offsets to the time of the oldest
+  sample, the base is moved when the ring is emptied. If the ring is full,
+  the oldest sample is overwritten. Memory is allocated once by
+  accelRing_init.
+*/
+
+typedef struct {
+	uint32_t offsetMs;          // to baseMs
+	int16_t x,y,z;
+} accelSample_t;
+
+typedef struct {
+	accelSample_t *samples;
+	int size;
+	int first;                  // oldest sample
+	int count;
+	uint64_t baseMs;            // wall clock time of the oldest sample when the ring was empty
+	int numAdded;               // statistics
+	int numOverwritten;
+} accelRing_t;
+
+// returns 0 on success
+int accelRing_init(accelRing_t *r, int size);
+void accelRing_free(accelRing_t *r);
+void accelRing_add(accelRing_t *r, uint64_t nowMs, int16_t x, int16_t y, int16_t z);
+// i-th oldest sample, 0 <= i < count, returns the timestamp in ms
+uint64_t accelRing_get(const accelRing_t *r, int i, accelSample_t *s);
+void accelRing_clear(accelRing_t *r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ACCELRING_H_INCLUDED
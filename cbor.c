@@ -0,0 +1,35 @@
+#include "cbor.h"
+
+#define CBOR_MAJOR_UINT 0
+#define CBOR_MAJOR_NEGINT 1
+#define CBOR_MAJOR_ARRAY 4
+
+// major type in the upper 3 bits, values < 24 are stored in the head byte
+static uint8_t * cbor_putHead(uint8_t *p, int major, uint64_t v) {
+	int len,i;
+
+	major <<= 5;
+	if (v < 24) {
+		*p++ = major | v;
+		return p;
+	}
+	if (v <= 0xff) { *p++ = major | 24; len = 1; }
+	else if (v <= 0xffff) { *p++ = major | 25; len = 2; }
+	else if (v <= 0xffffffff) { *p++ = major | 26; len = 4; }
+	else { *p++ = major | 27; len = 8; }
+	for (i=len-1;i>=0;i--) *p++ = v >> (i * 8);     // big endian
+	return p;
+}
+
+uint8_t * cbor_putUint(uint8_t *p, uint64_t v) {
+	return cbor_putHead(p, CBOR_MAJOR_UINT, v);
+}
+
+uint8_t * cbor_putInt(uint8_t *p, int64_t v) {
+	if (v >= 0) return cbor_putHead(p, CBOR_MAJOR_UINT, v);
+	return cbor_putHead(p, CBOR_MAJOR_NEGINT, -1 - v);
+}
+
+uint8_t * cbor_putArray(uint8_t *p, uint64_t numItems) {
+	return cbor_putHead(p, CBOR_MAJOR_ARRAY, numItems);
+}
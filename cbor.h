@@ -0,0 +1,26 @@
+#ifndef CBOR_H_INCLUDED
+#define CBOR_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/*
+  Minimal CBOR (RFC 8949) encoder for fixed layout payloads.
+  Integers are written in the shortest form, each function returns
+  the position following the encoded item.
+*/
+
+#define CBOR_MAX_ITEM_LEN 9     // head byte + 64 bit argument
+
+uint8_t * cbor_putUint(uint8_t *p, uint64_t v);
+uint8_t * cbor_putInt(uint8_t *p, int64_t v);
+uint8_t * cbor_putArray(uint8_t *p, uint64_t numItems);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CBOR_H_INCLUDED
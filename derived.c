@@ -0,0 +1,77 @@
+#include "derived.h"
+#include <stdint.h>
+#include <string.h>
+
+// Magnus coefficients (Alduchov and Eskridge 1996), saturation vapour pressure in hPa
+#define MAGNUS_A 17.625
+#define MAGNUS_B 243.04
+#define MAGNUS_C 6.1094
+#define WATER_VAPOUR_FACTOR 216.7       // g*K/(m³*hPa), M(water)/R
+#define KELVIN 273.15
+
+#define LN2 0.6931471805599453
+#define LOG2E 1.4426950408889634
+#define SQRT2 1.4142135623730951
+#define ROUND_MAGIC 0x1.8p52            // adding it rounds to an integer stored in the low mantissa bits
+
+static inline uint64_t asBits(double d) {
+	uint64_t u;
+	memcpy(&u,&d,sizeof(u));
+	return u;
+}
+
+static inline double asDouble(uint64_t u) {
+	double d;
+	memcpy(&d,&u,sizeof(d));
+	return d;
+}
+
+// e^x = 2^k * e^r with r = x - k*ln2 in [-ln2/2,ln2/2], e^r by its taylor polynomial up to r^8
+static inline double fastExp(double x) {
+	double t = x * LOG2E + ROUND_MAGIC;
+	double k = t - ROUND_MAGIC;
+	double r = x - k * LN2;
+	double p = 1 + r * (1 + r * (1.0/2 + r * (1.0/6 + r * (1.0/24 + r * (1.0/120 + r * (1.0/720 + r * (1.0/5040 + r * (1.0/40320))))))));
+
+	// k is in the low bits of t, 2^k is built by setting the exponent
+	return p * asDouble((asBits(t) + 1023) << 52);
+}
+
+// log x = e*ln2 + log m with m in [sqrt(1/2),sqrt(2)), log m = 2*atanh(s) with s = (m-1)/(m+1)
+static inline double fastLog(double x) {
+	uint64_t u = asBits(x);
+	// m > sqrt(2) by the upper mantissa bits, 32 bit compares vectorize without SSE4.2
+	uint64_t big = (int32_t)((u >> 32) & 0xfffff) > (int32_t)0x6a09e;
+	uint64_t exponent = (u >> 52) + big;
+	double m = asDouble(((u & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL) - (big << 52));  // halved if big
+	// integer to double without a conversion instruction
+	double e = asDouble(0x4330000000000000ULL | exponent) - 0x1p52 - 1023;
+	double s,s2;
+
+	s = (m - 1) / (m + 1);
+	s2 = s * s;
+	return e * LN2 + 2 * s * (1 + s2 * (1.0/3 + s2 * (1.0/5 + s2 * (1.0/7 + s2 * (1.0/9 + s2 * (1.0/11))))));
+}
+
+double derived_exp(double x) {
+	return fastExp(x);
+}
+
+double derived_log(double x) {
+	return fastLog(x);
+}
+
+void derived_compute(int n, const double *temp, const double *humidity, double * restrict dewPoint, double * restrict absHumidity, double * restrict vpd) {
+	for (int i=0;i<n;i++) {
+		double t = temp[i];
+		double rh = humidity[i];
+		double gammaSat = MAGNUS_A * t / (MAGNUS_B + t);
+		double gamma = fastLog(rh * 0.01) + gammaSat;
+		double es = MAGNUS_C * fastExp(gammaSat);   // saturation vapour pressure
+		double e = es * rh * 0.01;                  // actual vapour pressure
+
+		dewPoint[i] = MAGNUS_B * gamma / (MAGNUS_A - gamma);
+		absHumidity[i] = WATER_VAPOUR_FACTOR * e / (KELVIN + t);
+		vpd[i] = (es - e) * 0.1;
+	}
+}
@@ -0,0 +1,30 @@
+#ifndef DERIVED_H_INCLUDED
+#define DERIVED_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+  Metrics derived from temperature (°C) and relative humidity (%) using the
+  Magnus formula over water. Computed in batches on arrays (one entry per
+  device), the loops are branch free and use polynomial approximations of
+  exp and log so they can be vectorized by the compiler.
+*/
+
+typedef enum {derived_dewpoint,derived_abshumidity,derived_vpd,derived_numMetrics} derivedMetric_t;
+
+// dew point in °C, absolute humidity in g/m³, vapour pressure deficit in kPa, humidity has to be > 0
+void derived_compute(int n, const double *temp, const double *humidity, double *dewPoint, double *absHumidity, double *vpd);
+
+// approximations used by derived_compute, relative error < 1e-8
+double derived_exp(double x);   // |x| < 700
+double derived_log(double x);   // x > 0, normal
+
+#define DERIVED_HUMIDITY_MIN 0.01      // log(0) is undefined, lower values should be clamped by the caller
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DERIVED_H_INCLUDED
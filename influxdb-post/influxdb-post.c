@@ -9,6 +9,9 @@
  *   Grafana using websockets
  *
  */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // sendmmsg
+#endif
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
@@ -24,18 +27,18 @@
 #include <time.h>
 #include "../log.h"
 #include <inttypes.h>
+#include <math.h>
 #include <assert.h>
 #include <time.h>
 #include<signal.h>
+#include <poll.h>
+#include <fcntl.h>
 
 #define INFLUX_TIMEOUT_SECONDS 5
 #define INFLUX_DEQUEUE_AT_ONCE 50
 
 #include "influxdb-post.h"
 
-// TODO: make this a paremeter
-#define WEBSOCKETS_PING_SECS 30
-
 /*
   Usage:
     send_udp/post_http(c,
@@ -57,6 +60,8 @@ int _format_line(influx_client_t* c, va_list ap);
 int send_udp_line(influx_client_t* c, char *line, int len);
 int _format_line2(influx_client_t* c, va_list ap);
 int _escaped_append(influx_client_t* c, const char* src, const char* escape_seq);
+int _deQueue(influx_client_t *c, int maxEntries);
+void queueRemoveFirst(influx_client_t *c);
 
 influx_client_t* influxdb_post_init (char* host, int port, char* db, char* user, char* pwd, char * org, char *bucket, char *token, int numQueueEntries, char *api
 #ifdef INFLUXDB_POST_LIBCURL
@@ -69,7 +74,14 @@ influx_client_t* influxdb_post_init (char* host, int port, char* db, char* user,
     if(! i) return i;
 
     memset((void*)i, 0, sizeof(influx_client_t));
+    if (host && strncasecmp(host,INFLUX_UDP_PREFIX,strlen(INFLUX_UDP_PREFIX)) == 0) {
+        host += strlen(INFLUX_UDP_PREFIX);
+        i->isUdp = 1;
+        i->udpSock = -1;
+        i->udpMtu = INFLUX_UDP_MTU;
+    }
     if(host) i->host=strdup(host);
+    if(host) i->name=strdup(host);
     if(port==0) i->port=8086; else i->port=port;
     if (db) i->db=strdup(db);
     if (user) i->usr=strdup(user);
@@ -81,6 +93,10 @@ influx_client_t* influxdb_post_init (char* host, int port, char* db, char* user,
     i->maxNumEntriesToQueue=numQueueEntries;
     i->lastNeededBufferSize = INFLUX_INITIAL_BUF_SIZE;
     i->firstConnectionAttempt = 1;
+    i->backoffMaxSecs = INFLUX_BACKOFF_MAX_SECS;
+    i->dequeuePerSec = INFLUX_DEQUEUE_PER_SEC;
+    i->wakeFd[0] = i->wakeFd[1] = -1;
+    i->randSeed = time(NULL) ^ getpid() ^ (uintptr_t)i;	// for backoff jitter
 #ifdef INFLUXDB_POST_LIBCURL
 	i->ssl_verifypeer = SSL_VerifyPeer;
 #endif
@@ -96,6 +112,10 @@ influx_client_t* influxdb_post_init_grafana (char* host, int port, char * grafan
 	if (i) {
 		i->isGrafana++;
 		i->grafanaPushID = strdup(grafanaPushID);
+		i->maxNumEntriesToQueue = INFLUX_GRAFANA_QUEUE_SIZE;
+		i->wsPingSecs = WEBSOCKETS_PING_SECS;
+		i->mergeFrames = 1;
+		i->backoffMaxSecs = INFLUX_BACKOFF_MAX_SECS / 10;	// live data, reconnect faster
 	}
 	return i;
 }
@@ -111,8 +131,262 @@ void influxdb_post_freeBuffer(influx_client_t *c) {
 	c->influxBufUsed = 0;
 }
 
+void influxdb_post_resetBuffer(influx_client_t *c) {
+	if (c->influxBuf) *c->influxBuf = 0;
+	c->influxBufUsed = 0;
+	c->last_type = 0;
+}
+
+void influxdb_flushPolicy_init(influx_flushPolicy_t *p, int maxPoints, size_t maxBytes, int maxAgeSecs, int minIntervalSecs) {
+	memset(p,0,sizeof(*p));
+	p->maxPoints = maxPoints > 0 ? maxPoints : 0;
+	p->maxBytes = maxBytes;
+	p->maxAgeSecs = maxAgeSecs > 0 ? maxAgeSecs : 0;
+	p->minIntervalSecs = minIntervalSecs > 0 ? minIntervalSecs : 0;
+	p->lastFlushTime = time(NULL);
+}
+
+void influxdb_post_setFlushPolicy(influx_client_t *c, int maxPoints, size_t maxBytes, int maxAgeSecs, int minIntervalSecs) {
+	if (!c) return;
+	influxdb_flushPolicy_init(&c->flushPolicy, maxPoints, maxBytes, maxAgeSecs, minIntervalSecs);
+}
+
+influx_flushReason_t influxdb_flush_check(influx_flushPolicy_t *p, int pendingPoints, size_t pendingBytes, time_t oldestPending, time_t now) {
+	if (pendingPoints <= 0) return influx_flush_none;
+	if (p->minIntervalSecs && now - p->lastFlushTime < p->minIntervalSecs) return influx_flush_none;
+	if (p->maxPoints && pendingPoints >= p->maxPoints) return influx_flush_points;
+	if (p->maxBytes && pendingBytes >= p->maxBytes) return influx_flush_bytes;
+	if (p->maxAgeSecs && oldestPending && now - oldestPending >= p->maxAgeSecs) return influx_flush_age;
+	if (!p->maxPoints && !p->maxBytes && !p->maxAgeSecs) return influx_flush_immediate;
+	return influx_flush_none;
+}
+
+void influxdb_flush_done(influx_flushPolicy_t *p, influx_flushReason_t reason, time_t now) {
+	if (reason > influx_flush_none && reason < influx_flush_numReasons) p->count[reason]++;
+	p->lastFlushTime = now;
+}
+
+void influxdb_flushPolicy_logStats(influx_flushPolicy_t *p, const char *name) {
+	LOGN(0,"%s: flushes by points: %lu, by bytes: %lu, by age: %lu, immediate: %lu",name,
+		p->count[influx_flush_points],p->count[influx_flush_bytes],p->count[influx_flush_age],p->count[influx_flush_immediate]);
+}
+
+const char * flushReasonStr[] = {"none","points","bytes","age","immediate"};
+
+const char *influxdb_flushReasonStr(influx_flushReason_t reason) {
+	if (reason < 0 || reason >= influx_flush_numReasons) return "unknown";
+	return flushReasonStr[reason];
+}
+
+const char * precisionStr[] = {"ns","s","ms","us"};
+const char * precisionParamStr[] = {"","&precision=s","&precision=ms","&precision=us"};
+const char * precisionParamStrV1[] = {"","&precision=s","&precision=ms","&precision=u"};
+const uint64_t precisionDivisor[] = {1,1000000000,1000000,1000};
+
+int influxdb_post_setPrecision(influx_client_t *c, const char *precision) {
+	if (!precision) return 0;
+	for (int i=0;i<influx_precision_numPrecisions;i++) {
+		if (strcmp(precision,precisionStr[i]) == 0) {
+			if (c) c->precision = (influx_precision_t)i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// returns the write parameter for the url, empty if the default (ns) is used
+const char * precisionParam(influx_client_t *c, int isV1) {
+	return isV1 ? precisionParamStrV1[c->precision] : precisionParamStr[c->precision];
+}
+
+size_t escapeStr(char *dest, const char *src, const char *escape_seq) {
+	char *d = dest;
+	while (*src) {
+		if (strchr(escape_seq,*src)) *d++ = '\\';
+		*d++ = *src++;
+	}
+	*d = 0;
+	return d - dest;
+}
+
+char * influxdb_format_prefix(const char *measurement, const char *tagKey, const char *tagValue, int *len) {
+	char *prefix,*p;
+
+	prefix = malloc(2 * (strlen(measurement) + strlen(tagKey) + strlen(tagValue)) + 3);
+	if (!prefix) return NULL;
+	p = prefix;
+	p += escapeStr(p, measurement, ", ");
+	*p++ = ',';
+	p += escapeStr(p, tagKey, ",= ");
+	*p++ = '=';
+	p += escapeStr(p, tagValue, ",= ");
+	if (len) *len = p - prefix;
+	return prefix;
+}
+
+char * influxdb_format_key(const char *key, int *len) {
+	char *escaped;
+	size_t l;
+
+	escaped = malloc(2 * strlen(key) + 1);
+	if (!escaped) return NULL;
+	l = escapeStr(escaped, key, ",= ");
+	if (len) *len = l;
+	return escaped;
+}
+
+static const double pow10Tab[] = {1,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,1e9};
+
+// same output as %.*f for values that fit into 63 bit after scaling
+int influxdb_fmtFixed(char *dest, double value, int precision) {
+	char digits[24];
+	char *d = dest;
+	int n = 0;
+	long long scaled;
+	unsigned long long u;
+	double r;
+
+	if (precision < 0 || precision > 9 || !(fabs(value) * pow10Tab[precision] < 9.0e18))
+		return sprintf(dest, "%.*f", precision, value);
+	r = value * pow10Tab[precision];
+	if (fabs(fabs(r - trunc(r)) - 0.5) < 1e-6)		// rounding may differ due to the scaling
+		return sprintf(dest, "%.*f", precision, value);
+	scaled = llround(r);
+	if (signbit(value)) *d++ = '-';
+	u = scaled < 0 ? -(unsigned long long)scaled : (unsigned long long)scaled;
+	do {
+		digits[n++] = '0' + u % 10;
+		u /= 10;
+	} while (u || n <= precision);
+	while (n > precision) *d++ = digits[--n];
+	if (precision) {
+		*d++ = '.';
+		while (n) *d++ = digits[--n];
+	}
+	*d = 0;
+	return d - dest;
+}
+
+#define INFLUX_MAX_VALUE_LEN 32
+
+int influxdb_append_float(influx_client_t *c, const char *escapedKey, int keyLen, double value, int precision) {
+	char *p;
+	size_t needed;
+
+	if (c->influxBufUsed == 0 || c->last_type < IF_TYPE_MEAS || c->last_type > IF_TYPE_FIELD_BOOLEAN) return -1;
+	needed = c->influxBufUsed + keyLen + INFLUX_MAX_VALUE_LEN + 2;
+	if (needed > c->influxBufLen) {
+		size_t newLen = c->influxBufLen * 2;
+		if (newLen < needed) newLen = needed;
+		p = realloc(c->influxBuf, newLen);
+		if (!p) return -2;
+		c->influxBuf = p;
+		c->influxBufLen = newLen;
+	}
+	p = c->influxBuf + c->influxBufUsed;
+	*p++ = c->last_type <= IF_TYPE_TAG ? ' ' : ',';
+	memcpy(p, escapedKey, keyLen);
+	p += keyLen;
+	*p++ = '=';
+	if (precision > 9) p += snprintf(p, INFLUX_MAX_VALUE_LEN, "%.*f", precision, value);
+	else p += influxdb_fmtFixed(p, value, precision);
+	*p = 0;
+	c->influxBufUsed = p - c->influxBuf;
+	c->last_type = IF_TYPE_FIELD_FLOAT;
+	return 0;
+}
+
+const char * circuitStateStr[] = {"closed","open","half-open"};
+
+void influxdb_post_logStats(influx_client_t *c, const char *name) {
+	if (!c) return;
+	if (c->threadRunning) pthread_mutex_lock(&c->lock);
+	if (c->threadRunning) influxdb_flushPolicy_logStats(&c->flushPolicy, name);
+	LOGN(0,"%s: queued: %d (%d points, %zu bytes), dropped: %lu, rejected: %lu, merged: %lu",name,c->numEntriesQueued,c->queuedPoints,c->queuedBytes,c->numDropped,c->numRejected,c->numMerged);
+	LOGN(0,"%s: circuit %s, failures: %lu, circuit opened: %lu, requests not send due to open circuit: %lu",name,
+		circuitStateStr[c->circuitState],c->numFailures,c->numCircuitOpened,c->numShortCircuited);
+	if (c->isUdp)
+		LOGN(0,"%s: udp datagrams sent: %lu, bytes: %lu, sendmmsg calls: %lu, oversized: %lu, errors: %lu, resolved: %lu",name,
+			c->udpDatagramsSent,c->udpBytesSent,c->udpNumSendCalls,c->udpNumOversized,c->udpNumErrors,c->udpNumResolved);
+	if (c->threadRunning) pthread_mutex_unlock(&c->lock);
+}
+
+void influxdb_post_setBackoff(influx_client_t *c, int maxBackoffSecs, int dequeuePerSec) {
+	if (!c) return;
+	if (maxBackoffSecs >= INFLUX_BACKOFF_MIN_SECS) c->backoffMaxSecs = maxBackoffSecs;
+	if (dequeuePerSec > 0) c->dequeuePerSec = dequeuePerSec;
+}
+
+void influxdb_post_setPingInterval(influx_client_t *c, int secs) {
+	if (!c) return;
+	if (secs >= 0) c->wsPingSecs = secs;
+}
+
+void influxdb_post_setUdpMtu(influx_client_t *c, int mtu) {
+	if (!c) return;
+	if (mtu > 0) c->udpMtu = mtu;
+}
+
+// returns 1 if a connection attempt is allowed
+int circuitAllow(influx_client_t *c, time_t now) {
+	if (c->circuitState != influx_circuit_open) return 1;
+	if (now < c->nextAttemptTime) {
+		c->numShortCircuited++;
+		return 0;
+	}
+	c->circuitState = influx_circuit_halfOpen;
+	LOGN(1,"%s: circuit half-open, trying to send",c->name);
+	return 1;
+}
+
+// status codes 4xx are caused by the data, not by the server
+int isSendFailure(int rc) {
+	return (rc != 0 && (rc < 200 || rc >= 500));
+}
+
+void circuitResult(influx_client_t *c, int failed, time_t now) {
+	int waitSecs;
+
+	if (!failed) {
+		if (c->circuitState != influx_circuit_closed)
+			LOGN(0,"%s: connection restored after %d failures, circuit closed",c->name,c->consecutiveFailures);
+		c->circuitState = influx_circuit_closed;
+		c->consecutiveFailures = 0;
+		c->backoffSecs = 0;
+		return;
+	}
+	c->numFailures++;
+	c->consecutiveFailures++;
+	if (c->circuitState == influx_circuit_closed && c->consecutiveFailures < INFLUX_CIRCUIT_FAILURE_THRESHOLD) return;
+
+	// exponential backoff with jitter, wait between backoff/2 and backoff
+	if (c->backoffSecs == 0) c->backoffSecs = INFLUX_BACKOFF_MIN_SECS;
+	else c->backoffSecs *= 2;
+	if (c->backoffSecs > c->backoffMaxSecs) c->backoffSecs = c->backoffMaxSecs;
+	waitSecs = c->backoffSecs / 2;
+	waitSecs += rand_r(&c->randSeed) % (c->backoffSecs - waitSecs + 1);
+	c->nextAttemptTime = now + waitSecs;
+	if (c->circuitState == influx_circuit_closed) {
+		c->numCircuitOpened++;
+		LOGN(0,"%s: %d consecutive failures, circuit open, next attempt in %d seconds",c->name,c->consecutiveFailures,waitSecs);
+	} else
+		LOGN(1,"%s: still failing, next attempt in %d seconds",c->name,waitSecs);
+	c->circuitState = influx_circuit_open;
+}
+
 void influxdb_post_deInit(influx_client_t *c) {
-     while (influxdb_deQueue(c) > 0) {};
+     if (c->threadRunning) influxdb_post_stopThread(c);
+     else while (_deQueue(c, INFLUX_DEQUEUE_AT_ONCE) > 0) {};
+     while (c->firstEntry) queueRemoveFirst(c);
+     while (c->freeEntries) {
+        struct influx_dataRow_t *t = c->freeEntries;
+        c->freeEntries = t->next;
+        free(t);
+     }
+     if (c->isUdp && c->udpSock >= 0) {
+        close(c->udpSock);
+        c->udpSock = -1;
+     }
 #ifndef INFLUXDB_POST_LIBCURL
      if(c->ainfo) {
         freeaddrinfo(c->ainfo);
@@ -127,6 +401,7 @@ void influxdb_post_free(influx_client_t *c) {
 	if (c) {
 		influxdb_post_deInit(c);
 		influxdb_post_freeBuffer(c);
+		free(c->name);
 		free(c->host);
 		free(c->db);
 		free(c->usr);
@@ -134,6 +409,7 @@ void influxdb_post_free(influx_client_t *c) {
 		free(c->org);
 		free(c->bucket);
 		free(c->token);
+		free(c->apiStr);
 		free(c->grafanaPushID);
 #ifdef INFLUXDB_POST_LIBCURL
 		free(c->url);
@@ -144,24 +420,20 @@ void influxdb_post_free(influx_client_t *c) {
 	}
 }
 
-#if 0
 int influxdb_send_udp(influx_client_t* c, ...) {
     int ret = 0, len;
     va_list ap;
-    char* line = NULL;
 
     va_start(ap, c);
-    len = _format_line(&line, ap);
+    len = _format_line(c, ap);
     va_end(ap);
     if(len < 0)
         return -1;
 
-    ret = send_udp_line(c, line, len);
-
-    free(line);
+    ret = send_udp_line(c, c->influxBuf, len);
+    influxdb_post_resetBuffer(c);
     return ret;
 }
-#endif // 0
 
 int influxdb_format_line(influx_client_t* c, ...) {
     va_list ap;
@@ -178,11 +450,10 @@ int influxdb_format_line(influx_client_t* c, ...) {
 
 
 int _begin_line(influx_client_t* c) {
-	if (c->influxBuf) {
-		free(c->influxBuf);
-		c->influxBuf = NULL;
-		c->influxBufLen = 0;
+	if (c->influxBuf) {		// reuse the buffer of the last lines
 		c->influxBufUsed = 0;
+		*c->influxBuf = 0;
+		return c->influxBufLen;
 	}
     int len = c->lastNeededBufferSize;
 	c->influxBuf = malloc(len);
@@ -254,7 +525,7 @@ int _format_line2(influx_client_t* c, va_list ap)
     double d = 0.0;
     char tempStr[MAX_FIELD_LENGTH+1];
 
-    if (c->influxBuf == NULL) {
+    if (c->influxBufUsed == 0) {
 	    _begin_line(c);
 	    //used = 0;
 	    c->last_type = 0;
@@ -283,6 +554,13 @@ int _format_line2(influx_client_t* c, va_list ap)
                 if(_escaped_append(c, va_arg(ap, char*), ",= "))
                     return -4;
                 break;
+            case IF_TYPE_PREFIX:
+                if(c->last_type && c->last_type <= IF_TYPE_TAG)
+                    goto FAIL;
+                if(c->last_type) _APPEND("\n");
+                if (appendToBuf (c, va_arg(ap, char*)) < 0) goto FAIL;
+                type = IF_TYPE_TAG;		// fields may follow
+                break;
             case IF_TYPE_FIELD_STRING:
                 _APPEND("\"");
                 if(_escaped_append(c, va_arg(ap, char*), "\""))
@@ -308,7 +586,7 @@ int _format_line2(influx_client_t* c, va_list ap)
                     goto FAIL;
 				}
                 i = va_arg(ap, long long);
-                _APPEND(" %" PRId64, i);
+                _APPEND(" %" PRId64, i / precisionDivisor[c->precision]);
                 break;
             case IF_TYPE_TIMESTAMP_NOW:
                 if(c->last_type < IF_TYPE_FIELD_STRING || c->last_type > IF_TYPE_FIELD_BOOLEAN) {
@@ -316,7 +594,7 @@ int _format_line2(influx_client_t* c, va_list ap)
                     goto FAIL;
 				}
                 i = influxdb_getTimestamp();
-                _APPEND(" %" PRId64, i);
+                _APPEND(" %" PRId64, i / precisionDivisor[c->precision]);
                 break;
             default:
 				printf("Unknown type %d\n",type);
@@ -335,7 +613,7 @@ int _format_line2(influx_client_t* c, va_list ap)
     //*_len = len;
     return 0;
 FAIL:
-	influxdb_post_freeBuffer(c);
+	influxdb_post_resetBuffer(c);
     return -20;
 }
 #undef _APPEND
@@ -408,18 +686,20 @@ int post_http_send_line(influx_client_t *c, char *buf, int len)
 
     if (c->org) {
 		// v2 api
-		char *httpHeaderFormat="POST /api/v2/write?org=%s&bucket=%s HTTP/1.1\r\nHost: %s\r\nContent-Length: %zd\r\nAuthorization: Token %s\r\n\r\n";
+		char *httpHeaderFormat="POST /api/v2/write?org=%s&bucket=%s%s HTTP/1.1\r\nHost: %s\r\nContent-Length: %zd\r\nAuthorization: Token %s\r\n\r\n";
 		int neededHeaderSize = strlen(httpHeaderFormat);
+		neededHeaderSize+=strlen(precisionParam(c,0));
 		neededHeaderSize+=strlen(c->org);
 		neededHeaderSize+=strlen(c->bucket);
 		neededHeaderSize+=strlen(c->token);
 		iv[0].iov_base=malloc(neededHeaderSize + 5);  // a litte bit to much due to escape chars, 5=content length
 		if (iv[0].iov_base==NULL) return -2;
-		sprintf((char *)iv[0].iov_base, httpHeaderFormat,c->org, c->bucket, c->host, iv[1].iov_len, c->token);
+		sprintf((char *)iv[0].iov_base, httpHeaderFormat,c->org, c->bucket, precisionParam(c,0), c->host, iv[1].iov_len, c->token);
 
     } else {
-		char *httpHeaderFormat="POST /write?db=%s%s%s%s%s HTTP/1.1\r\nHost: %s\r\nContent-Length: %zd\r\n\r\n";
+		char *httpHeaderFormat="POST /write?db=%s%s%s%s%s%s HTTP/1.1\r\nHost: %s\r\nContent-Length: %zd\r\n\r\n";
 		int neededHeaderSize = strlen(httpHeaderFormat);
+		neededHeaderSize+=strlen(precisionParam(c,1));
 		if (c->usr) neededHeaderSize+=strlen(c->usr)+3;
 		if (c->pwd) neededHeaderSize+=strlen(c->pwd)+3;
 		if (! c->db) {
@@ -431,7 +711,7 @@ int post_http_send_line(influx_client_t *c, char *buf, int len)
 		iv[0].iov_base=malloc(neededHeaderSize + 5);  // a litte bit to much due to escape chars, 5=content length
 		if (iv[0].iov_base==NULL) return -2;
 		sprintf((char *)iv[0].iov_base, httpHeaderFormat,
-            c->db, c->usr ? "&u=" : "",c->usr ? c->usr : "", c->pwd ? "&p=" : "", c->pwd ? c->pwd : "", c->host, iv[1].iov_len);
+            c->db, c->usr ? "&u=" : "",c->usr ? c->usr : "", c->pwd ? "&p=" : "", c->pwd ? c->pwd : "", precisionParam(c,1), c->host, iv[1].iov_len);
 	}
     LOGN(2,"httpHeader initialized:\n---------------\n%s\n---------------\n",(char *)iv[0].iov_base);
 
@@ -604,6 +884,90 @@ static int curlDebugCallback(CURL *handle, curl_infotype type, char *data, size_
 }
 
 
+// closes the connection, will be reconnected on the next send
+void wsClose(influx_client_t *c) {
+	//curl_slist_free_all(c->ch);  // sigsegv sometimes with curl 8.4.0 ??
+	curl_easy_cleanup(c->ch);
+	c->ch = NULL;
+	free(c->url); c->url = NULL;
+}
+
+// waits until the websocket is readable or writable, returns >0 if ready
+int wsWait(influx_client_t *c, short events, int timeoutMs) {
+	struct pollfd pfd;
+	curl_socket_t sock;
+
+	if (curl_easy_getinfo(c->ch, CURLINFO_ACTIVESOCKET, &sock) != CURLE_OK || sock == CURL_SOCKET_BAD) return -1;
+	pfd.fd = sock;
+	pfd.events = events;
+	return poll(&pfd, 1, timeoutMs);
+}
+
+// reads pending frames, pings will be answered by libcurl
+int wsReceive(influx_client_t *c) {
+	char buf[256];
+	size_t rlen;
+	const struct curl_ws_frame *meta;
+	int res;
+
+	c->wsLastActivity = time(NULL);
+	do {
+		res = curl_ws_recv(c->ch, buf, sizeof(buf), &rlen, &meta);
+		if (res == CURLE_OK && meta && (meta->flags & CURLWS_CLOSE)) {
+			LOGN(0,"%s: websocket closed by server",c->name);
+			wsClose(c);
+			return -1;
+		}
+	} while (res == CURLE_OK);
+	if (res != CURLE_AGAIN) {
+		LOGN(1,"curl_ws_recv from \"%s\" failed with %d (%s), closing connection",c->url,res,curl_easy_strerror(res));
+		wsClose(c);
+		return -1;
+	}
+	return 0;
+}
+
+// sends a frame, waits for the socket if the send buffer is full
+int wsSend(influx_client_t *c, char *buf, int len, int showSendErr) {
+	size_t sent;
+	int res;
+
+	while (len) {
+		sent = 0;
+		res = curl_ws_send(c->ch, buf, len, &sent, 0, CURLWS_TEXT);
+		if (res == CURLE_AGAIN) {
+			len -= sent;
+			buf += sent;
+			if (wsWait(c, POLLOUT, INFLUX_TIMEOUT_SECONDS * 1000) > 0) continue;
+			res = CURLE_OPERATION_TIMEDOUT;
+		}
+		if (res) {
+			if (showSendErr) EPRINTFN("curl_ws_send to \"%s\" failed with %d (%s), closing connection",c->url,res,curl_easy_strerror(res));
+			wsClose(c);
+			return -1;
+		}
+		len -= sent;
+		buf += sent;
+	}
+	c->wsLastActivity = time(NULL);
+	return 0;
+}
+
+// keepalive, the pong will be read by wsReceive
+int wsPing(influx_client_t *c) {
+	size_t sent;
+	int res;
+
+	res = curl_ws_send(c->ch, "", 0, &sent, 0, CURLWS_PING);
+	if (res && res != CURLE_AGAIN) {
+		LOGN(1,"%s: websocket ping failed with %d (%s), closing connection",c->name,res,curl_easy_strerror(res));
+		wsClose(c);
+		return -1;
+	}
+	c->wsLastActivity = time(NULL);
+	return 0;
+}
+
 int post_http_send_line(influx_client_t *c, char *buf, int len, int showSendErr) {
 	int res;
 	long response_code;
@@ -691,6 +1055,7 @@ int post_http_send_line(influx_client_t *c, char *buf, int len, int showSendErr)
 						}
 					}
 					VPRINTFN(0,"Connected to grafana at %s",c->url);
+					c->wsLastActivity = time(NULL);
 				}
 			}
 
@@ -710,14 +1075,15 @@ int post_http_send_line(influx_client_t *c, char *buf, int len, int showSendErr)
 			} else
 			if (!c->isGrafana && c->org) {
 				// v2 api
-				char *urlFormat="%s/api/v2/write?org=%s&bucket=%s";
+				char *urlFormat="%s/api/v2/write?org=%s&bucket=%s%s";
 				int urlSize = strlen(urlFormat);
+				urlSize+=strlen(precisionParam(c,0));
 				urlSize+=strlen(c->host);
 				urlSize+=strlen(c->org);
 				urlSize+=strlen(c->bucket);
 				c->url = malloc(urlSize);
 				if (c->url==NULL) return -2;
-				sprintf((char *)c->url, urlFormat,c->host,c->org, c->bucket);
+				sprintf((char *)c->url, urlFormat,c->host,c->org, c->bucket, precisionParam(c,0));
 
 				char *authFormat = "Authorization: Token %s";
 				int authSize = strlen(authFormat)-2;
@@ -732,8 +1098,9 @@ int post_http_send_line(influx_client_t *c, char *buf, int len, int showSendErr)
 				PRINTFN("Using influxdb2 at %s",c->url);
 			} else
 			if (!c->isGrafana) {
-				char *urlFormat="%s/write?db=%s%s%s%s%s";
+				char *urlFormat="%s/write?db=%s%s%s%s%s%s";
 				int urlSize = strlen(urlFormat);
+				urlSize+=strlen(precisionParam(c,1));
 				urlSize+=strlen(c->host);
 				if (c->usr) urlSize+=strlen(c->usr)+3;
 				if (c->pwd) urlSize+=strlen(c->pwd)+3;
@@ -746,7 +1113,7 @@ int post_http_send_line(influx_client_t *c, char *buf, int len, int showSendErr)
 				c->url=(char *)malloc(urlSize);
 				if (c->url==NULL) return -2;
 				sprintf(c->url, urlFormat,
-					c->host, c->db, c->usr ? "&u=" : "",c->usr ? c->usr : "", c->pwd ? "&p=" : "", c->pwd ? c->pwd : "");
+					c->host, c->db, c->usr ? "&u=" : "",c->usr ? c->usr : "", c->pwd ? "&p=" : "", c->pwd ? c->pwd : "", precisionParam(c,1));
 				PRINTF("Using influxdb1 at %s",c->url);
 			}
 		}
@@ -755,36 +1122,8 @@ int post_http_send_line(influx_client_t *c, char *buf, int len, int showSendErr)
 	}
 
 	if (c->isWebsocket) {
-		size_t sent = 0;
-		size_t rlen;
-		const struct curl_ws_frame *meta;
-
-		// this is to answer ping handled by libcurl
-		curl_ws_recv(c->ch, NULL, 0, &rlen, &meta);
-		//if (res) LOGN(8,"curl_ws_recv 1 (CURLWS_PING) to \"%s\" failed with %d (%s), closing connection",c->url,res,curl_easy_strerror(res));
-
-		if (!len) return 0;		// only to answer ping from server
-
-		while (len) {
-			curl_easy_setopt(c->ch,CURLOPT_VERBOSE, 1);
-			res = curl_ws_send(c->ch, buf, len, &sent, 0, CURLWS_TEXT);
-			curl_easy_setopt(c->ch,CURLOPT_VERBOSE, 0);
-			if (res) {
-				if (showSendErr) EPRINTFN("curl_ws_send to \"%s\" failed with %d (%s), closing connection",c->url,res,curl_easy_strerror(res));
-				//curl_slist_free_all(c->ch);  // sigsegv sometimes with curl 8.4.0 ??
-				//EPRINTFN("curl_slist_free_all: done");
-				curl_easy_cleanup(c->ch);
-				//VPRINTFN(4,"curl_easy_cleanup: done");
-				c->ch = NULL;	// reconnect next time
-				//EPRINTFN("curl_ws_send to \"%s\" closed connection",c->url);
-				free(c->url); c->url = NULL;
-				//kill(getpid(),SIGINT);	// terminate for debug
-				return -1;
-			}
-			len -= sent;
-			buf += sent;
-		}
-		return 0;
+		if (!len) return wsReceive(c);		// only to answer ping from server
+		return wsSend(c, buf, len, showSendErr);
 	} else {
 		if (len <= 0) return 0;
 		/* Set size of the POST data */
@@ -824,30 +1163,212 @@ int post_http_send_line(influx_client_t *c, char *buf, int len, int showSendErr)
 #endif // INFLUXDB_POST_LIBCURL
 
 
+// buffers are released by the sender threads
+static influx_sharedBuf_t *sharedBufPool;
+static int sharedBufPoolCount;
+static pthread_mutex_t sharedBufPoolLock = PTHREAD_MUTEX_INITIALIZER;
+
+influx_sharedBuf_t * influxdb_sharedBuf_detach(influx_client_t *c, int points) {
+	influx_sharedBuf_t *b;
+	char *data;
+	size_t size;
+
+	if (!c->influxBuf) return NULL;
+	pthread_mutex_lock(&sharedBufPoolLock);
+	b = sharedBufPool;
+	if (b) {
+		sharedBufPool = b->next;
+		sharedBufPoolCount--;
+	}
+	pthread_mutex_unlock(&sharedBufPoolLock);
+	if (!b) {
+		b = calloc(1,sizeof(*b));
+		if (!b) return NULL;
+	}
+	// swap the buffers, c continues with the (already allocated) buffer of the pool entry
+	data = b->data;
+	size = b->size;
+	b->data = c->influxBuf;
+	b->size = c->influxBufLen;
+	b->len = c->influxBufUsed;
+	b->points = points;
+	b->refCount = 1;
+	b->next = NULL;
+	c->influxBuf = data;
+	c->influxBufLen = size;
+	influxdb_post_resetBuffer(c);
+	return b;
+}
+
+void influxdb_sharedBuf_release(influx_sharedBuf_t *b) {
+	if (!b) return;
+	if (__atomic_sub_fetch(&b->refCount, 1, __ATOMIC_ACQ_REL) == 0) {
+		pthread_mutex_lock(&sharedBufPoolLock);
+		if (sharedBufPoolCount < INFLUX_SHAREDBUF_POOL_MAX) {
+			b->next = sharedBufPool;
+			sharedBufPool = b;
+			sharedBufPoolCount++;
+			b = NULL;
+		}
+		pthread_mutex_unlock(&sharedBufPoolLock);
+		if (b) {
+			free(b->data);
+			free(b);
+		}
+	}
+}
+
+// returns an unused buffer with at least size bytes
+influx_sharedBuf_t * sharedBufAlloc(size_t size) {
+	influx_sharedBuf_t *b;
+	char *data;
+
+	pthread_mutex_lock(&sharedBufPoolLock);
+	b = sharedBufPool;
+	if (b) {
+		sharedBufPool = b->next;
+		sharedBufPoolCount--;
+	}
+	pthread_mutex_unlock(&sharedBufPoolLock);
+	if (!b) {
+		b = calloc(1,sizeof(*b));
+		if (!b) return NULL;
+	}
+	if (b->size < size) {
+		data = realloc(b->data, size);
+		if (!data) {
+			free(b->data);
+			free(b);
+			return NULL;
+		}
+		b->data = data;
+		b->size = size;
+	}
+	b->len = 0;
+	b->points = 0;
+	b->refCount = 1;
+	b->next = NULL;
+	return b;
+}
+
+// returns the end of the element starting at s, elements are separated by an unescaped sep outside of quotes
+const char * lineElementEnd(const char *s, const char *end, char sep) {
+	int quoted = 0;
+
+	while (s < end) {
+		if (*s == '\\' && s + 1 < end) s++;
+		else if (*s == '"') quoted = !quoted;
+		else if (!quoted && (*s == sep || (sep == ',' && *s == ' '))) return s;
+		s++;
+	}
+	return end;
+}
+
+int fieldKeyLen(const char *field, const char *end) {
+	return lineElementEnd(field, end, '=') - field;
+}
+
+// merges the fields of two single line frames with the same measurement and tags, fields of newer
+// overwrite the fields of older, the timestamp of newer is used. Returns NULL if the frames can not be merged
+influx_sharedBuf_t * mergeFrames(influx_sharedBuf_t *older, influx_sharedBuf_t *newer) {
+	const char *oEnd = older->data + older->len;
+	const char *nEnd = newer->data + newer->len;
+	const char *oFields, *nFields, *oFieldsEnd, *nFieldsEnd, *f, *fEnd, *n, *nEnd2;
+	influx_sharedBuf_t *m;
+	char *d;
+	int prefixLen, keyLen, found;
+
+	if (memchr(older->data, '\n', older->len) || memchr(newer->data, '\n', newer->len)) return NULL;
+	oFields = lineElementEnd(older->data, oEnd, ' ');
+	nFields = lineElementEnd(newer->data, nEnd, ' ');
+	prefixLen = oFields - older->data;
+	if (prefixLen != nFields - newer->data || memcmp(older->data, newer->data, prefixLen) != 0) return NULL;
+	if (oFields >= oEnd || nFields >= nEnd) return NULL;
+	oFields++; nFields++;
+	oFieldsEnd = lineElementEnd(oFields, oEnd, ' ');
+	nFieldsEnd = lineElementEnd(nFields, nEnd, ' ');
+
+	m = sharedBufAlloc(older->len + newer->len + 1);
+	if (!m) return NULL;
+	d = m->data;
+	memcpy(d, older->data, prefixLen + 1);		// measurement,tags and space
+	d += prefixLen + 1;
+	// fields of older not in newer
+	for (f = oFields; f < oFieldsEnd; f = fEnd + 1) {
+		fEnd = lineElementEnd(f, oFieldsEnd, ',');
+		keyLen = fieldKeyLen(f, fEnd);
+		found = 0;
+		for (n = nFields; n < nFieldsEnd && !found; n = nEnd2 + 1) {
+			nEnd2 = lineElementEnd(n, nFieldsEnd, ',');
+			if (fieldKeyLen(n, nEnd2) == keyLen && memcmp(f, n, keyLen) == 0) found++;
+		}
+		if (!found) {
+			memcpy(d, f, fEnd - f);
+			d += fEnd - f;
+			*d++ = ',';
+		}
+	}
+	memcpy(d, nFields, nEnd - nFields);		// fields and timestamp of newer
+	d += nEnd - nFields;
+	*d = 0;
+	m->len = d - m->data;
+	m->points = newer->points;
+	return m;
+}
+
+struct influx_dataRow_t * newEntry(influx_client_t *c) {
+	struct influx_dataRow_t *t = c->freeEntries;
+
+	if (t) {
+		c->freeEntries = t->next;
+		return t;
+	}
+	return malloc(sizeof(*t));
+}
+
+void queueAppend(influx_client_t *c, struct influx_dataRow_t *t) {
+	t->next = NULL;
+	t->sentLen = 0;
+	if (c->lastEntry) c->lastEntry->next = t;
+	else c->firstEntry = t;
+	c->lastEntry = t;
+	c->numEntriesQueued++;
+	c->queuedPoints += t->buf->points;
+	c->queuedBytes += t->buf->len;
+}
+
+void queueRemoveFirst(influx_client_t *c) {
+	struct influx_dataRow_t *t = c->firstEntry;
+
+	if (!t) return;
+	c->firstEntry = t->next;
+	if (!c->firstEntry) c->lastEntry = NULL;
+	c->numEntriesQueued--;
+	c->queuedPoints -= t->buf->points;
+	c->queuedBytes -= t->buf->len;
+	influxdb_sharedBuf_release(t->buf);
+	t->next = c->freeEntries;
+	c->freeEntries = t;
+}
+
 int addToQueue (influx_client_t* c) {
     struct influx_dataRow_t *t;
-    struct influx_dataRow_t *t2;
 
     if (c->numEntriesQueued < c->maxNumEntriesToQueue) {
-        t = malloc(sizeof(*t));
+        t = newEntry(c);
         if (! t) return -1;
-        t->next=NULL;
-        t->postData=c->influxBuf;
-        c->influxBuf=NULL;
-        c->influxBufLen=0;
-        c->influxBufUsed=0;
-        if (! c->firstEntry) {
-            c->firstEntry=t;
-        } else {
-            t2=c->firstEntry;
-            while (t2->next) t2=t2->next;
-            t2->next=t;
+        t->buf = influxdb_sharedBuf_detach(c, 0);
+        if (! t->buf) {
+            t->next = c->freeEntries;
+            c->freeEntries = t;
+            return -1;
         }
+        t->queuedTime = time(NULL);
         if (c->numEntriesQueued==0) {
             LOGN(0,"Beginning queueing of records due to failures posting to influxdb (max: %d)",c->maxNumEntriesToQueue);
         } else
             LOGN(1,"Due to failure sending data, record has been queued as #%d",c->numEntriesQueued);
-        c->numEntriesQueued++;
+        queueAppend(c, t);
         return 0;
     } else {
         //LOGN((c->maxNumEntriesToQueue>0),"Failed sending data and will not queue (numEntriesQueued(%d) < maxNumEntriesToQueue(%d), record lost", c->numEntriesQueued, c->maxNumEntriesToQueue);
@@ -856,39 +1377,348 @@ int addToQueue (influx_client_t* c) {
 }
 
 
-int influxdb_deQueue(influx_client_t *c) {
+// 1 if the result of sendLineNoCircuit counts as a failure for the circuit breaker
+int sendFailed(influx_client_t* c, int rc) {
+	return c->isUdp ? rc != 0 : isSendFailure(rc);
+}
+
+// send without updating the circuit breaker, retry once on websocket send errors
+int sendLineNoCircuit(influx_client_t* c, char *buf, int len) {
+	int ret_code;
+
+	if (c->isUdp) return send_udp_line(c, buf, len);
+	ret_code = post_http_send_line(c, buf, len, 0);
+	if (ret_code == -1 && c->circuitState == influx_circuit_closed) ret_code = post_http_send_line(c, buf, len, 1);
+	return ret_code;
+}
+
+// send with circuit breaker
+int sendLine(influx_client_t* c, char *buf, int len) {
+	time_t now = time(NULL);
+	int ret_code;
+
+	if (!circuitAllow(c, now)) return INFLUX_CIRCUIT_OPEN;
+	ret_code = sendLineNoCircuit(c, buf, len);
+	circuitResult(c, sendFailed(c, ret_code), now);
+	return ret_code;
+}
+
+
+int _deQueue(influx_client_t *c, int maxEntries) {
+    struct influx_dataRow_t *t;
     int numDequeued=0;
     int res;
-    struct influx_dataRow_t *t;
 
     if (c->numEntriesQueued) {
-        LOGN(0,"beginning dequeing to %s, %d remaining",c->url,c->numEntriesQueued);
+        LOGN(1,"beginning dequeing to %s, %d remaining",c->name,c->numEntriesQueued);
         do {
-            //if (c->firstEntry) {}
-            res = post_http_send_line(c, c->firstEntry->postData, strlen(c->firstEntry->postData),1);
+            t = c->firstEntry;
+            res = sendLine(c, t->buf->data + t->sentLen, t->buf->len - t->sentLen);
+            if (res != 0 && c->isUdp) t->sentLen += c->udpSentLen;
             if (res == 0) {
-                t = c->firstEntry;
-                c->firstEntry = t->next;
-                free(t->postData);
-                free(t);
-                numDequeued++; c->numEntriesQueued--;
+                queueRemoveFirst(c);
+                numDequeued++;
                 //LOGN(0,"dequeue first: success, remaining: %d",c->numEntriesQueued);
             } else {
-                LOGN(0,"dequeue: post_http_send_line to %s failed with %d",c->url,res);
+                if (res != INFLUX_CIRCUIT_OPEN) LOGN(0,"dequeue: post_http_send_line to %s failed with %d",c->url ? c->url : c->host,res);
                 return -1;
             }
-        } while((numDequeued < INFLUX_DEQUEUE_AT_ONCE) && (res == 0) && (c->numEntriesQueued));
+        } while((numDequeued < maxEntries) && (res == 0) && (c->numEntriesQueued));
         if (numDequeued>0) {
             char s[20];
             if (c->numEntriesQueued) sprintf(s,"%d left",c->numEntriesQueued);
             else strcpy(s,"=all");
-            LOGN(0,"%d entr%s (%s) dequeued and successfully posted to %s",numDequeued, numDequeued > 1 ? "ies" : "y", s, c->url);
+            LOGN((c->numEntriesQueued ? 1 : 0),"%d entr%s (%s) dequeued and successfully posted to %s",numDequeued, numDequeued > 1 ? "ies" : "y", s, c->url);
         }
     }
     return numDequeued;
 }
 
 
+// number of queued entries that can be send now, rate limited while draining after failures
+int drainLimit(influx_client_t *c, time_t now) {
+	long maxEntries;
+
+	if (!c->backlog) return INFLUX_DEQUEUE_AT_ONCE;
+	if (c->lastDequeueTime == 0) maxEntries = c->dequeuePerSec;
+	else maxEntries = (long)(now - c->lastDequeueTime) * c->dequeuePerSec;
+	if (maxEntries <= 0) return 0;
+	if (maxEntries > INFLUX_DEQUEUE_AT_ONCE) maxEntries = INFLUX_DEQUEUE_AT_ONCE;
+	c->lastDequeueTime = now;
+	return maxEntries;
+}
+
+
+// drains the queue with at most dequeuePerSec entries per second to not overload a recovering server
+int influxdb_deQueue(influx_client_t *c) {
+	int maxEntries;
+
+	if (!c->numEntriesQueued) return 0;
+	if (c->circuitState == influx_circuit_open) return 0;
+	c->backlog = 1;
+	maxEntries = drainLimit(c, time(NULL));
+	if (maxEntries <= 0) return 0;
+	return _deQueue(c, maxEntries);
+}
+
+
+// appends the queued data to the send buffer of c
+int appendQueuedData(influx_client_t *c, influx_sharedBuf_t *b) {
+	size_t needed = c->influxBufUsed + b->len + 2;
+
+	if (needed > c->influxBufLen) {
+		char *newBuf = realloc(c->influxBuf, needed);
+		if (!newBuf) return -1;
+		c->influxBuf = newBuf;
+		c->influxBufLen = needed;
+	}
+	if (c->influxBufUsed) c->influxBuf[c->influxBufUsed++] = '\n';
+	memcpy(c->influxBuf + c->influxBufUsed, b->data, b->len);
+	c->influxBufUsed += b->len;
+	c->influxBuf[c->influxBufUsed] = 0;
+	return 0;
+}
+
+// 1 if the server is available but rejected the data (4xx), sending it again would not help
+int sendRejected(influx_client_t* c, int rc) {
+	return rc != 0 && !sendFailed(c, rc);
+}
+
+// posts the given rows with one request, called without lock, the circuit breaker
+// is checked and updated by the caller with lock held. If the request is rejected or
+// the buffer can not be allocated, the rows are send one by one so that only the bad
+// ones are dropped. numDone is set to the number of rows sent or rejected, these can
+// be removed from the queue, numRejected to the number of rows rejected
+int sendRows(influx_client_t *c, struct influx_dataRow_t **rows, int numRows, int *numDone, int *numRejected) {
+	int i,rc = -2;
+
+	*numDone = 0;
+	*numRejected = 0;
+	if (c->isUdp) {
+		// one row at a time, a failed row is continued after its last datagram sent
+		for (i=0;i<numRows;i++) {
+			rc = send_udp_line(c, rows[i]->buf->data + rows[i]->sentLen, rows[i]->buf->len - rows[i]->sentLen);
+			if (rc != 0) {
+				rows[i]->sentLen += c->udpSentLen;
+				break;
+			}
+			(*numDone)++;
+		}
+		return rc;
+	}
+	if (numRows > 1) {
+		influxdb_post_resetBuffer(c);
+		for (i=0;i<numRows;i++)
+			if (appendQueuedData(c, rows[i]->buf) < 0) break;
+		if (i == numRows) rc = sendLineNoCircuit(c, c->influxBuf, c->influxBufUsed);
+		influxdb_post_resetBuffer(c);
+		if (rc == 0) {
+			*numDone = numRows;
+			return 0;
+		}
+		if (rc != -2 && !sendRejected(c, rc)) return rc;
+	}
+	for (i=0;i<numRows;i++) {
+		rc = sendLineNoCircuit(c, rows[i]->buf->data, rows[i]->buf->len);
+		if (rc != 0 && !sendRejected(c, rc)) break;
+		if (rc != 0) {
+			LOGN(0,"%s: %d points rejected by the server with %d, dropped",c->name,rows[i]->buf->points,rc);
+			(*numRejected)++;
+		}
+		(*numDone)++;
+	}
+	return rc;
+}
+
+#define INFLUX_THREAD_WAKEUP_SECS 1
+
+#ifdef INFLUXDB_POST_LIBCURL
+#define INFLUX_WS_IDLE_WAKEUP_SECS 60
+
+// waits for new data to send, reads from the websocket only if readable (pings are answered by libcurl)
+// and sends a ping if the connection was idle for wsPingSecs. Called with lock held,
+// returns -1 if there is no open websocket connection
+int threadWaitWebsocket(influx_client_t *c) {
+	struct pollfd fds[2];
+	curl_socket_t sock;
+	char drain[64];
+	int waitSecs,queued;
+	time_t now;
+
+	if (!c->isWebsocket || !c->ch || c->wakeFd[0] < 0) return -1;
+	if (curl_easy_getinfo(c->ch, CURLINFO_ACTIVESOCKET, &sock) != CURLE_OK || sock == CURL_SOCKET_BAD) return -1;
+	fds[0].fd = c->wakeFd[0];
+	fds[0].events = POLLIN;
+	fds[1].fd = sock;
+	fds[1].events = POLLIN;
+	queued = c->firstEntry != NULL;
+	pthread_mutex_unlock(&c->lock);
+	now = time(NULL);
+	if (c->wsPingSecs && now - c->wsLastActivity >= c->wsPingSecs) {
+		if (wsPing(c) != 0) {
+			pthread_mutex_lock(&c->lock);
+			return 0;
+		}
+	}
+	waitSecs = c->wsPingSecs ? c->wsLastActivity + c->wsPingSecs - now : INFLUX_WS_IDLE_WAKEUP_SECS;
+	// entries held back by the flush policy are checked as often as without websocket
+	if (queued && waitSecs > INFLUX_THREAD_WAKEUP_SECS) waitSecs = INFLUX_THREAD_WAKEUP_SECS;
+	if (waitSecs < 1) waitSecs = 1;
+	if (poll(fds, 2, waitSecs * 1000) > 0) {
+		if (fds[0].revents) while (read(c->wakeFd[0], drain, sizeof(drain)) > 0) {};
+		if (fds[1].revents) post_http_send_line(c, NULL, 0, 1);
+	}
+	pthread_mutex_lock(&c->lock);
+	return 0;
+}
+#endif
+
+void * influxdb_post_thread(void *arg) {
+	influx_client_t *c = (influx_client_t *)arg;
+	struct influx_dataRow_t *rows[INFLUX_DEQUEUE_AT_ONCE];
+	struct influx_dataRow_t *t;
+	influx_flushReason_t reason;
+	struct timespec ts;
+	int numRows,numDone,numRejected,maxRows,rc;
+	time_t now;
+
+	pthread_mutex_lock(&c->lock);
+	while (1) {
+		now = time(NULL);
+		numRows = 0;
+		reason = influx_flush_none;
+		if (c->firstEntry && (c->circuitState != influx_circuit_open || now >= c->nextAttemptTime)) {
+			if (c->terminate) reason = influx_flush_immediate;
+			else reason = influxdb_flush_check(&c->flushPolicy, c->queuedPoints, c->queuedBytes, c->firstEntry->queuedTime, now);
+			if (reason != influx_flush_none) {
+				maxRows = c->terminate ? INFLUX_DEQUEUE_AT_ONCE : drainLimit(c, now);
+				for (t = c->firstEntry; t && numRows < maxRows; t = t->next) rows[numRows++] = t;
+			}
+		}
+		if (numRows) {
+			// the main thread only appends to the queue or merges entries not in flight, the rows collected stay valid
+			circuitAllow(c, now);		// open -> half-open, nextAttemptTime has been checked above
+			c->numInFlight = numRows;
+			pthread_mutex_unlock(&c->lock);
+			rc = sendRows(c, rows, numRows, &numDone, &numRejected);
+			pthread_mutex_lock(&c->lock);
+			if (rc != -2) circuitResult(c, sendFailed(c, rc), now);
+			c->numInFlight = 0;
+			c->connected = !sendFailed(c, rc);
+			c->numRejected += numRejected;
+			for (int i=0;i<numDone;i++) queueRemoveFirst(c);
+			if (numDone == numRows) {
+				influxdb_flush_done(&c->flushPolicy, reason, now);
+				if (!c->firstEntry) {
+					if (c->backlog) LOGN(0,"%s: all cached entries posted",c->name);
+					c->backlog = 0;
+				}
+				continue;
+			}
+			if (!c->backlog && rc != INFLUX_CIRCUIT_OPEN) {
+				LOGN(0,"%s: post failed with %d, data will be cached (max: %d entries)",c->name,rc,c->maxNumEntriesToQueue);
+				c->backlog = 1;
+			}
+		}
+		if (c->terminate) break;
+#ifdef INFLUXDB_POST_LIBCURL
+		if (threadWaitWebsocket(c) == 0) continue;
+#endif
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += INFLUX_THREAD_WAKEUP_SECS;
+		pthread_cond_timedwait(&c->cond, &c->lock, &ts);
+	}
+	pthread_mutex_unlock(&c->lock);
+	return NULL;
+}
+
+int influxdb_post_startThread(influx_client_t *c) {
+	int rc;
+
+	if (!c) return -1;
+	if (c->threadRunning) return 0;
+	if (c->maxNumEntriesToQueue < 1) c->maxNumEntriesToQueue = 1;
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->cond, NULL);
+	if (c->isGrafana && pipe2(c->wakeFd, O_NONBLOCK | O_CLOEXEC) != 0) c->wakeFd[0] = c->wakeFd[1] = -1;
+	c->terminate = 0;
+	c->threadRunning = 1;
+	rc = pthread_create(&c->thread, NULL, influxdb_post_thread, c);
+	if (rc != 0) {
+		EPRINTFN("%s: failed to create sender thread (%d)",c->name,rc);
+		c->threadRunning = 0;
+		pthread_cond_destroy(&c->cond);
+		pthread_mutex_destroy(&c->lock);
+		return -1;
+	}
+	return 0;
+}
+
+void influxdb_post_stopThread(influx_client_t *c) {
+	if (!c) return;
+	if (!c->threadRunning) return;
+	pthread_mutex_lock(&c->lock);
+	c->terminate = 1;
+	pthread_cond_signal(&c->cond);
+	if (c->wakeFd[1] >= 0) {
+		if (write(c->wakeFd[1], "", 1) < 0) {};
+	}
+	pthread_mutex_unlock(&c->lock);
+	pthread_join(c->thread, NULL);
+	c->threadRunning = 0;
+	if (c->wakeFd[0] >= 0) {
+		close(c->wakeFd[0]);
+		close(c->wakeFd[1]);
+		c->wakeFd[0] = c->wakeFd[1] = -1;
+	}
+	pthread_cond_destroy(&c->cond);
+	pthread_mutex_destroy(&c->lock);
+	if (c->numEntriesQueued) LOGN(0,"%s: %d queued entries not posted",c->name,c->numEntriesQueued);
+}
+
+int influxdb_post_enqueue(influx_client_t *c, influx_sharedBuf_t *b) {
+	struct influx_dataRow_t *t;
+
+	if (!c || !b) return -1;
+	pthread_mutex_lock(&c->lock);
+	// the last entry can be merged if it is not being send
+	if (c->mergeFrames && c->lastEntry && c->numEntriesQueued > c->numInFlight
+	    && (!c->connected || c->numEntriesQueued >= c->maxNumEntriesToQueue)) {
+		influx_sharedBuf_t *m = mergeFrames(c->lastEntry->buf, b);
+		if (m) {
+			c->queuedPoints += m->points - c->lastEntry->buf->points;
+			c->queuedBytes += m->len - c->lastEntry->buf->len;
+			influxdb_sharedBuf_release(c->lastEntry->buf);
+			c->lastEntry->buf = m;
+			c->numMerged++;
+			pthread_mutex_unlock(&c->lock);
+			return 0;
+		}
+	}
+	if (c->numEntriesQueued >= c->maxNumEntriesToQueue) {
+		c->numDropped++;
+		pthread_mutex_unlock(&c->lock);
+		LOGN(1,"%s: queue full (%d entries), data dropped",c->name,c->maxNumEntriesToQueue);
+		return -2;
+	}
+	t = newEntry(c);
+	if (!t) {
+		pthread_mutex_unlock(&c->lock);
+		return -1;
+	}
+	__atomic_add_fetch(&b->refCount, 1, __ATOMIC_ACQ_REL);
+	t->buf = b;
+	t->queuedTime = time(NULL);
+	queueAppend(c, t);
+	pthread_cond_signal(&c->cond);
+	if (c->wakeFd[1] >= 0) {
+		if (write(c->wakeFd[1], "", 1) < 0) {};		// pipe full, thread will wake up anyway
+	}
+	pthread_mutex_unlock(&c->lock);
+	return 0;
+}
+
+
 int influxdb_post_http(influx_client_t* c, ...)
 {
     va_list ap;
@@ -897,6 +1727,10 @@ int influxdb_post_http(influx_client_t* c, ...)
     va_start(ap, c);
     len = _format_line(c, ap);
     va_end(ap);
+    if (!circuitAllow(c, time(NULL))) {
+		influxdb_post_resetBuffer(c);
+		return INFLUX_CIRCUIT_OPEN;
+    }
     if(len < 0) {
 		post_http_send_line(c, NULL, 0, 1);	// for ws ping
         return 0;
@@ -905,71 +1739,148 @@ int influxdb_post_http(influx_client_t* c, ...)
     ret_code = post_http_send_line(c, c->influxBuf, len,0);	// do not show send errors
     if (ret_code != 0 && ret_code < 400)
 	ret_code = post_http_send_line(c, c->influxBuf, len,1);	// show send errors here
+    // len is 0 if called for ws ping only, count failures (e.g. reconnect) but no success without data
+    if (len > 0 || isSendFailure(ret_code)) circuitResult(c, isSendFailure(ret_code), time(NULL));
 
     if (ret_code != 0 && ret_code < 400) {
-		addToQueue(c);
-		c->influxBuf=NULL;
+		addToQueue(c);		// moves the buffer to the queue on success
     }
     else {
         influxdb_deQueue(c);
     }
-    influxdb_post_freeBuffer(c);
+    influxdb_post_resetBuffer(c);
     return ret_code;
 }
 
 // line will be free'd or added to queue if influxdb server is unavailable
 int influxdb_post_http_line(influx_client_t* c)
 {
-    int ret_code = 0, len = strlen(c->influxBuf);
+    int ret_code = 0, len = c->influxBufUsed;
 
-    //ret_code = post_http_send_line(c, c->influxBuf, len, 0);	// dont show send errors
-    //if (ret_code != 0 && (ret_code < 200 || ret_code >= 500))
-	//	ret_code = post_http_send_line(c, c->influxBuf, len, 1);	// retry and show send errors
-	ret_code = post_http_send_line(c, c->influxBuf, len, 0);
-	if (ret_code == -1) ret_code = post_http_send_line(c, c->influxBuf, len, 1);
+	ret_code = sendLine(c, c->influxBuf, len);
     //printf("rc from post_http_send_line: %d\n",ret_code);
-    if (ret_code != 0 && (ret_code < 200 || ret_code >= 500)) {
-        if (addToQueue(c)<0) {
-            influxdb_post_freeBuffer(c);     // queue full, must ignore this one
-        } else {
-			c->influxBuf = NULL;			// pointer moved to queue so no free is needed in influxdb_post_freeBuffer
-			influxdb_post_freeBuffer(c);
-        }
+    if (ret_code != 0 && c->isUdp && c->udpSentLen) {
+        // datagrams already sent are not queued again
+        c->influxBufUsed -= c->udpSentLen;
+        memmove(c->influxBuf, c->influxBuf + c->udpSentLen, c->influxBufUsed);
+        c->influxBuf[c->influxBufUsed] = 0;
+    }
+    if (isSendFailure(ret_code)) {
+        if (addToQueue(c)<0) c->numDropped++;	// queue full, must ignore this one
+        influxdb_post_resetBuffer(c);			// data has been moved to the queue on success
     } else {
-        influxdb_post_freeBuffer(c);
+        influxdb_post_resetBuffer(c);
         influxdb_deQueue(c);
     }
     return ret_code;
 }
 
-#if 0
-int send_udp_line(influx_client_t* c, char *line, int len)
-{
-    int sock = 0, ret = 0;
-    struct sockaddr_in addr;
+// (re)resolves the host and creates the socket if needed
+int udpResolve(influx_client_t* c, time_t now) {
+    struct addrinfo hints, *ai;
+    char service[30];
+    int res;
 
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(c->port);
-    if((addr.sin_addr.s_addr = inet_addr(c->host)) == INADDR_NONE) {
-        ret = -2;
-        goto END;
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    sprintf(service,"%d",c->port);
+    c->udpResolveTime = now;
+    res = getaddrinfo(c->host, service, &hints, &ai);
+    if (res != 0) {
+        LOGN(0,"%s: unable to resolve host %s:%s (%s)",c->name,c->host,service,gai_strerror(res));
+        return c->udpSock >= 0 ? 0 : -2;    // keep using the last address
     }
-
-    if((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-        ret = -3;
-        goto END;
+    if (c->udpSock >= 0 && c->udpAddr.ss_family != ai->ai_family) {
+        close(c->udpSock);
+        c->udpSock = -1;
     }
-
-    if(sendto(sock, line, len, 0, (struct sockaddr *)&addr, sizeof(addr)) < len) {
-        //fprintf(stderr,"sendto failed\n");
-        ret = -4;
+    if (c->udpSock < 0) {
+        c->udpSock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (c->udpSock < 0) {
+            LOGN(0,"%s: unable to create udp socket (%s)",c->name,strerror(errno));
+            freeaddrinfo(ai);
+            return -3;
+        }
     }
+    memcpy(&c->udpAddr, ai->ai_addr, ai->ai_addrlen);
+    c->udpAddrLen = ai->ai_addrlen;
+    c->udpNumResolved++;
+    freeaddrinfo(ai);
+    return 0;
+}
 
-END:
-    close(sock);
-    return ret;
+#define INFLUX_UDP_BATCH 64     // datagrams per sendmmsg
+
+// splits line into datagrams of max udpMtu bytes on line boundaries, lines longer than udpMtu are dropped.
+// On failure, udpSentLen is set to the length of the data already sent that must not be sent again
+int send_udp_line(influx_client_t* c, char *line, int len)
+{
+    struct mmsghdr msgs[INFLUX_UDP_BATCH];
+    struct iovec iovecs[INFLUX_UDP_BATCH];
+    char *end = line + len;
+    char *begin = line;
+    char *start, *lineEnd, *dgEnd;
+    time_t now = time(NULL);
+    int numMsgs, sent, i, res;
+
+    c->udpSentLen = 0;
+    if (c->udpSock < 0 || now - c->udpResolveTime >= INFLUX_UDP_RESOLVE_SECS) {
+        res = udpResolve(c, now);
+        if (res < 0) return res;
+    }
+    while (line < end) {
+        numMsgs = 0;
+        while (line < end && numMsgs < INFLUX_UDP_BATCH) {
+            while (line < end && *line == '\n') line++;
+            if (line >= end) break;
+            start = line;
+            dgEnd = NULL;
+            do {    // add lines while the datagram fits into the mtu
+                lineEnd = memchr(line, '\n', end - line);
+                if (!lineEnd) lineEnd = end;
+                if (dgEnd && lineEnd - start > c->udpMtu) break;
+                dgEnd = lineEnd;
+                line = lineEnd < end ? lineEnd + 1 : end;
+            } while (line < end);
+            if (dgEnd - start > c->udpMtu) {    // a single line, resending would not help
+                c->udpNumOversized++;
+                LOGN(1,"%s: line of %d bytes exceeds the mtu of %d bytes, dropped",c->name,(int)(dgEnd - start),c->udpMtu);
+                continue;
+            }
+            iovecs[numMsgs].iov_base = start;
+            iovecs[numMsgs].iov_len = dgEnd - start;
+            memset(&msgs[numMsgs], 0, sizeof(msgs[0]));
+            msgs[numMsgs].msg_hdr.msg_name = &c->udpAddr;
+            msgs[numMsgs].msg_hdr.msg_namelen = c->udpAddrLen;
+            msgs[numMsgs].msg_hdr.msg_iov = &iovecs[numMsgs];
+            msgs[numMsgs].msg_hdr.msg_iovlen = 1;
+            numMsgs++;
+        }
+        sent = 0;
+        while (sent < numMsgs) {
+            res = sendmmsg(c->udpSock, &msgs[sent], numMsgs - sent, 0);
+            if (res < 0) {
+                if (errno == EINTR) continue;
+                c->udpNumErrors++;
+                LOGN(1,"%s: sendmmsg failed (%s)",c->name,strerror(errno));
+                if (errno == EMSGSIZE) {    // the datagram will never fit, skip it instead of queuing the data again
+                    sent++;
+                    continue;
+                }
+                c->udpResolveTime = 0;     // re-resolve on next send
+                c->udpSentLen = (char *)iovecs[sent].iov_base - begin;
+                return -4;
+            }
+            c->udpNumSendCalls++;
+            for (i = sent; i < sent + res; i++) c->udpBytesSent += msgs[i].msg_len;
+            c->udpDatagramsSent += res;
+            sent += res;
+        }
+    }
+    c->udpSentLen = len;
+    return 0;
 }
-#endif // 0
 
 uint64_t influxdb_getTimestamp()  {
 int res;
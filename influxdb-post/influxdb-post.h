@@ -17,6 +17,9 @@ extern "C" {
 //#include <stdio.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <pthread.h>
 
 #ifndef ESP32
 #define INFLUXDB_POST_LIBCURL
@@ -52,21 +55,69 @@ extern "C" {
 #define INFLUX_F_FLT(k, v, p) IF_TYPE_FIELD_FLOAT, (k), (double)(v), (int)(p)
 #define INFLUX_F_INT(k, v)    IF_TYPE_FIELD_INTEGER, (k), (long long)(v)
 #define INFLUX_F_BOL(k, v)    IF_TYPE_FIELD_BOOLEAN, (k), ((v) ? 1 : 0)
+#define INFLUX_PREFIX(p)      IF_TYPE_PREFIX, (p)
 #define INFLUX_TS(ts)         IF_TYPE_TIMESTAMP, (long long)(ts)
 #define INFLUX_TSNOW          IF_TYPE_TIMESTAMP_NOW
 #define INFLUX_END            IF_TYPE_ARG_END
 
 #define INFLUX_INITIAL_BUF_SIZE 0x100
 
+// backoff and circuit breaker for failed connections
+#define INFLUX_BACKOFF_MIN_SECS 1
+#define INFLUX_BACKOFF_MAX_SECS 300
+#define INFLUX_CIRCUIT_FAILURE_THRESHOLD 3    // consecutive failures until the circuit opens
+#define INFLUX_DEQUEUE_PER_SEC 10             // max queued entries posted per second after a failure
+#define INFLUX_GRAFANA_QUEUE_SIZE 16          // frames queued for grafana, merged if full
+#define WEBSOCKETS_PING_SECS 30               // default keepalive interval for idle websocket connections
+#define INFLUX_CIRCUIT_OPEN -30               // returned if a request has not been send because the circuit is open
+
+// udp sink, used if the host is prefixed by udp://
+#define INFLUX_UDP_PREFIX "udp://"
+#define INFLUX_UDP_MTU 1400                   // max payload of a datagram, lines are not split
+#define INFLUX_UDP_RESOLVE_SECS 300           // re-resolve the host name
+
+typedef enum {influx_circuit_closed,influx_circuit_open,influx_circuit_halfOpen} influx_circuitState_t;
+
+// timestamp precision, timestamps passed to INFLUX_TS are always in nanoseconds
+typedef enum {influx_precision_ns,influx_precision_s,influx_precision_ms,influx_precision_us,influx_precision_numPrecisions} influx_precision_t;
+
+// reasons for writing pending data, immediate is used if no trigger is set
+typedef enum {influx_flush_none,influx_flush_points,influx_flush_bytes,influx_flush_age,influx_flush_immediate,influx_flush_numReasons} influx_flushReason_t;
+
+// flush policy, a trigger set to 0 is disabled
+typedef struct {
+	int maxPoints;              // flush if at least this number of points are pending
+	size_t maxBytes;            // flush if the pending line protocol data reaches this size
+	int maxAgeSecs;             // flush if the oldest pending point is older
+	int minIntervalSecs;        // do not flush more often, has precedence over the triggers above
+	time_t lastFlushTime;
+	unsigned long count[influx_flush_numReasons];
+} influx_flushPolicy_t;
+
+// formatted data that can be queued for multiple clients, returned to a pool when the last client released it
+typedef struct influx_sharedBuf_t {
+	char *data;
+	size_t len;
+	size_t size;        // allocated size of data
+	int points;
+	int refCount;
+	struct influx_sharedBuf_t *next;    // pool of unused buffers
+} influx_sharedBuf_t;
+
+#define INFLUX_SHAREDBUF_POOL_MAX 8     // unused buffers kept for reuse
+
 struct influx_dataRow_t
 {
-    char* postData;
+    influx_sharedBuf_t *buf;
+    time_t queuedTime;
+    size_t sentLen;             // udp: bytes already sent as datagrams, only the rest is resent
     struct influx_dataRow_t* next;
 };
 
 
 typedef struct _influx_client_t
 {
+    char* name;   // for logging, defaults to host
     char* host;
     int   port;
     char* db;  // http only v1 api
@@ -78,14 +129,65 @@ typedef struct _influx_client_t
     char *apiStr; // if set,db..token will be ignored and only this string is send in the http header, e.g. /write?username=Admin?password=questdb
     int maxNumEntriesToQueue;  // for buffer in case of send failures
     int numEntriesQueued;
+    int queuedPoints;
+    size_t queuedBytes;
+    unsigned long numDropped;
+    unsigned long numRejected;  // queued entries dropped because the server rejected the data (4xx)
     struct influx_dataRow_t* firstEntry;
+    struct influx_dataRow_t* lastEntry;
+    struct influx_dataRow_t* freeEntries;  // reused for the next entries
 
     int lastNeededBufferSize;
     size_t influxBufUsed;
 	size_t influxBufLen;
 	char * influxBuf;
 	int last_type;
-
+	influx_precision_t precision;
+
+	influx_flushPolicy_t flushPolicy;   // for queued data if a sender thread is used
+
+	// circuit breaker, while open no connection attempts will be made until nextAttemptTime
+	influx_circuitState_t circuitState;
+	int consecutiveFailures;
+	int backoffSecs;
+	int backoffMaxSecs;
+	time_t nextAttemptTime;
+	int dequeuePerSec;
+	time_t lastDequeueTime;
+	unsigned long numFailures;
+	unsigned long numShortCircuited;
+	unsigned long numCircuitOpened;
+	unsigned int randSeed;      // backoff jitter, rand_r as several sender threads may run
+	int backlog;                // set after a send failure, queue will be drained rate limited
+
+	// sender thread, queue and the fields above are protected by lock while the thread is running
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int threadRunning;
+	int terminate;
+	int numInFlight;            // entries at the start of the queue currently being send
+	int connected;              // last send succeeded
+	int mergeFrames;            // merge single line frames latest value wins while disconnected or queue is full
+	unsigned long numMerged;
+	int wakeFd[2];              // wakes up the sender thread while waiting for websocket data
+	int wsPingSecs;             // send a ping if idle, 0=off
+	time_t wsLastActivity;
+
+	// udp, fire and forget
+	int isUdp;
+	int udpSock;
+	int udpMtu;
+	struct sockaddr_storage udpAddr;
+	socklen_t udpAddrLen;
+	time_t udpResolveTime;
+	size_t udpSentLen;          // bytes sent by the last send_udp_line, up to the end of the last datagram sent
+	unsigned long udpDatagramsSent;
+	unsigned long udpBytesSent;
+	unsigned long udpNumSendCalls;
+	unsigned long udpNumOversized;
+	unsigned long udpNumErrors;
+	unsigned long udpNumResolved;
 
 #ifdef INFLUXDB_POST_LIBCURL
 	int isGrafana;
@@ -112,10 +214,47 @@ influx_client_t* influxdb_post_init_grafana (char* host, int port, char * grafan
 #endif // INFLUXDB_POST_LIBCURL
 
 void influxdb_post_freeBuffer(influx_client_t *c);
+// empties the buffer but keeps the allocated memory for the next lines
+void influxdb_post_resetBuffer(influx_client_t *c);
 int influxdb_deQueue(influx_client_t *c);
 void influxdb_post_deInit(influx_client_t *c);
 void influxdb_post_free(influx_client_t *c);
 
+void influxdb_flushPolicy_init(influx_flushPolicy_t *p, int maxPoints, size_t maxBytes, int maxAgeSecs, int minIntervalSecs);
+// returns the reason why pending data should be written now or influx_flush_none
+influx_flushReason_t influxdb_flush_check(influx_flushPolicy_t *p, int pendingPoints, size_t pendingBytes, time_t oldestPending, time_t now);
+// to be called after pending data has been written
+void influxdb_flush_done(influx_flushPolicy_t *p, influx_flushReason_t reason, time_t now);
+const char *influxdb_flushReasonStr(influx_flushReason_t reason);
+void influxdb_flushPolicy_logStats(influx_flushPolicy_t *p, const char *name);
+void influxdb_post_setFlushPolicy(influx_client_t *c, int maxPoints, size_t maxBytes, int maxAgeSecs, int minIntervalSecs);
+void influxdb_post_setBackoff(influx_client_t *c, int maxBackoffSecs, int dequeuePerSec);
+void influxdb_post_setUdpMtu(influx_client_t *c, int mtu);
+void influxdb_post_setPingInterval(influx_client_t *c, int secs);
+// s, ms, us or ns, returns 0 on success, c may be NULL to validate only
+int influxdb_post_setPrecision(influx_client_t *c, const char *precision);
+
+// takes the formatted data of c, c gets an unused buffer from the pool, the returned buffer has a refCount of 1
+influx_sharedBuf_t * influxdb_sharedBuf_detach(influx_client_t *c, int points);
+void influxdb_sharedBuf_release(influx_sharedBuf_t *b);
+
+// sender thread, posts queued data according to the flush policy of the client
+int influxdb_post_startThread(influx_client_t *c);
+// sends remaining data if possible and terminates the thread
+void influxdb_post_stopThread(influx_client_t *c);
+// adds a reference to b to the queue of c and wakes up the sender thread
+int influxdb_post_enqueue(influx_client_t *c, influx_sharedBuf_t *b);
+
+// returns a malloc'd escaped "measurement,tagKey=tagValue" to be used with INFLUX_PREFIX
+char * influxdb_format_prefix(const char *measurement, const char *tagKey, const char *tagValue, int *len);
+void influxdb_post_logStats(influx_client_t *c, const char *name);
+// returns a malloc'd escaped field key to be used with influxdb_append_float
+char * influxdb_format_key(const char *key, int *len);
+// appends a field to the current line, faster than influxdb_format_line with INFLUX_F_FLT
+int influxdb_append_float(influx_client_t *c, const char *escapedKey, int keyLen, double value, int precision);
+// same output as sprintf(dest,"%.*f",precision,value) for precision 0..9, returns the length
+int influxdb_fmtFixed(char *dest, double value, int precision);
+
 
 uint64_t influxdb_getTimestamp();  // nanoseconds since 1970
 //int _format_line(char **buf, int *len, size_t used, ...);
@@ -131,13 +270,14 @@ int influxdb_send_udp(influx_client_t* c, ...);
 #define IF_TYPE_FIELD_BOOLEAN 6
 #define IF_TYPE_TIMESTAMP     7
 #define IF_TYPE_TIMESTAMP_NOW 8
+#define IF_TYPE_PREFIX        9     // pre-escaped measurement and tags
 
 //int _escaped_append(char** dest, size_t* len, size_t* used, const char* src, const char* escape_seq);
 //int _begin_line(char **buf);
 //int _format_line(char** buf, va_list ap);
 //int _format_line2(char** buf, va_list ap, size_t *, size_t);
 //int post_http_send_line(influx_client_t *c, char *buf, int len);
-//int send_udp_line(influx_client_t* c, char *line, int len);
+int send_udp_line(influx_client_t* c, char *line, int len);
 
 
 int influxdb_format_line(influx_client_t* c, ...); //char **buf, int *len , size_t used, ...);
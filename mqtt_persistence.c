@@ -0,0 +1,468 @@
+#include "mqtt_persistence.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PLOG_MAGIC 0x474f4c50           // "PLOG"
+#define PLOG_TYPE_PUT 1
+#define PLOG_TYPE_REMOVE 2
+#define PLOG_ALIGN(len) (((len) + 7) & ~(size_t)7)
+
+// key and data follow the header, the magic is written last
+typedef struct {
+	uint32_t magic;                     // 0 marks the end of the log
+	uint32_t checksum;                  // of type, key and data
+	uint32_t type;
+	uint32_t keyLen;
+	uint32_t dataLen;
+	uint32_t reserved;
+} plogRecord_t;
+
+typedef struct plogEntry_t plogEntry_t;
+struct plogEntry_t {
+	char *key;
+	size_t offset;                      // of the put record
+	plogEntry_t *next;
+};
+
+typedef struct {
+	mqtt_persistenceT *p;
+	char *fileName;
+	int fd;
+	uint8_t *map;
+	size_t mapSize;
+	size_t tail;                        // offset of the end marker
+	size_t liveBytes;                   // size of the put records still referenced
+	plogEntry_t *entries;               // in order of the log
+	plogEntry_t *lastEntry;
+	int numEntries;
+} plogT;
+
+#define PLOG_RECORD_LEN(keyLen,dataLen) PLOG_ALIGN(sizeof(plogRecord_t) + (keyLen) + (dataLen))
+#define PLOG_KEY(rec) ((char *)(rec) + sizeof(plogRecord_t))
+#define PLOG_DATA(rec) ((uint8_t *)(rec) + sizeof(plogRecord_t) + (rec)->keyLen)
+
+
+// fnv-1a
+static uint32_t plog_checksum(const plogRecord_t *rec) {
+	const uint8_t *s = (const uint8_t *)PLOG_KEY(rec);
+	size_t len = rec->keyLen + rec->dataLen;
+	uint32_t h = 2166136261u ^ rec->type;
+
+	while (len--) {
+		h ^= *s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+
+static plogEntry_t * plog_find(plogT *l, const char *key, plogEntry_t **prev) {
+	plogEntry_t *e;
+
+	*prev = NULL;
+	for (e = l->entries; e; e = e->next) {
+		if (strcmp(e->key, key) == 0) return e;
+		*prev = e;
+	}
+	return NULL;
+}
+
+
+static void plog_unlink(plogT *l, plogEntry_t *e, plogEntry_t *prev) {
+	const plogRecord_t *rec = (const plogRecord_t *)(l->map + e->offset);
+
+	if (prev) prev->next = e->next;
+	else l->entries = e->next;
+	if (l->lastEntry == e) l->lastEntry = prev;
+	l->liveBytes -= PLOG_RECORD_LEN(rec->keyLen, rec->dataLen);
+	l->numEntries--;
+	free(e->key);
+	free(e);
+}
+
+
+static int plog_addEntry(plogT *l, const char *key, size_t offset) {
+	plogEntry_t *e = calloc(1, sizeof(plogEntry_t));
+	const plogRecord_t *rec = (const plogRecord_t *)(l->map + offset);
+
+	if (!e) return -1;
+	e->key = strdup(key);
+	if (!e->key) { free(e); return -1; }
+	e->offset = offset;
+	if (l->lastEntry) l->lastEntry->next = e;
+	else l->entries = e;
+	l->lastEntry = e;
+	l->liveBytes += PLOG_RECORD_LEN(rec->keyLen, rec->dataLen);
+	l->numEntries++;
+	return 0;
+}
+
+
+static void plog_freeEntries(plogT *l) {
+	while (l->entries) plog_unlink(l, l->entries, NULL);
+}
+
+
+// blocks are allocated, writing to the mapping can not fail with SIGBUS on a full disk
+static int plog_map(plogT *l, int fd, size_t size) {
+	uint8_t *map;
+	int rc;
+
+	rc = posix_fallocate(fd, 0, size);
+	if (rc != 0) {
+		EPRINTFN("mqtt persistence: unable to allocate %zu bytes for %s (%s)", size, l->fileName, strerror(rc));
+		return -1;
+	}
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		EPRINTFN("mqtt persistence: mmap of %s failed (%s)", l->fileName, strerror(errno));
+		return -1;
+	}
+	if (l->map) munmap(l->map, l->mapSize);
+	l->map = map;
+	l->mapSize = size;
+	return 0;
+}
+
+
+static void plog_setEnd(plogT *l, size_t offset) {
+	l->tail = offset;
+	if (offset + sizeof(uint32_t) <= l->mapSize) *(uint32_t *)(l->map + offset) = 0;
+}
+
+
+// writes the live records to a new file that replaces the log, the log is unchanged on failure
+static int plog_compact(plogT *l, size_t size) {
+	plogT n;
+	char *tmpName;
+	size_t len;
+	int fd;
+
+	len = strlen(l->fileName) + sizeof(".tmp");
+	tmpName = malloc(len);
+	if (!tmpName) return -1;
+	snprintf(tmpName, len, "%s.tmp", l->fileName);
+	fd = open(tmpName, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		EPRINTFN("mqtt persistence: unable to create %s (%s)", tmpName, strerror(errno));
+		free(tmpName);
+		return -1;
+	}
+	memset(&n, 0, sizeof(n));
+	n.fileName = tmpName;
+	if (plog_map(&n, fd, size) != 0) {
+		close(fd);
+		unlink(tmpName);
+		free(tmpName);
+		return -1;
+	}
+	for (plogEntry_t *e = l->entries; e; e = e->next) {
+		const plogRecord_t *rec = (const plogRecord_t *)(l->map + e->offset);
+		len = PLOG_RECORD_LEN(rec->keyLen, rec->dataLen);
+		memcpy(n.map + n.tail, rec, len);
+		n.tail += len;
+	}
+	plog_setEnd(&n, n.tail);
+	msync(n.map, n.mapSize, MS_SYNC);
+	if (rename(tmpName, l->fileName) != 0) {
+		// the old log would be replayed on restart, keep appending to it
+		EPRINTFN("mqtt persistence: unable to rename %s (%s)", tmpName, strerror(errno));
+		munmap(n.map, n.mapSize);
+		close(fd);
+		unlink(tmpName);
+		free(tmpName);
+		return -1;
+	}
+	free(tmpName);
+	// same order as copied above
+	n.tail = 0;
+	for (plogEntry_t *e = l->entries; e; e = e->next) {
+		const plogRecord_t *rec = (const plogRecord_t *)(l->map + e->offset);
+		e->offset = n.tail;
+		n.tail += PLOG_RECORD_LEN(rec->keyLen, rec->dataLen);
+	}
+	munmap(l->map, l->mapSize);
+	close(l->fd);
+	l->map = n.map;
+	l->mapSize = n.mapSize;
+	l->fd = fd;
+	l->tail = n.tail;
+	l->p->numCompactions++;
+	return 0;
+}
+
+
+// makes room for len bytes plus the end marker
+static int plog_reserve(plogT *l, size_t len) {
+	size_t needed = l->tail + len + sizeof(uint32_t);
+	size_t size = l->mapSize;
+
+	if (needed <= l->mapSize) return 0;
+	// mostly removed records, compacting avoids growing the file, grow if compacting failed
+	if (l->liveBytes + len + sizeof(uint32_t) <= l->mapSize / 2 && plog_compact(l, l->mapSize) == 0)
+		return 0;
+	while (size < needed) size *= 2;
+	return plog_map(l, l->fd, size);
+}
+
+
+static int plog_append(plogT *l, uint32_t type, const char *key, int bufcount, char *buffers[], int buflens[], size_t *offset) {
+	plogRecord_t *rec;
+	size_t keyLen = strlen(key);
+	size_t dataLen = 0;
+	uint8_t *p;
+	int i;
+
+	for (i=0;i<bufcount;i++) dataLen += buflens[i];
+	if (plog_reserve(l, PLOG_RECORD_LEN(keyLen, dataLen)) != 0) return -1;
+
+	rec = (plogRecord_t *)(l->map + l->tail);
+	rec->magic = 0;
+	rec->type = type;
+	rec->keyLen = keyLen;
+	rec->dataLen = dataLen;
+	rec->reserved = 0;
+	p = (uint8_t *)PLOG_KEY(rec);
+	memcpy(p, key, keyLen);
+	p += keyLen;
+	for (i=0;i<bufcount;i++) {
+		memcpy(p, buffers[i], buflens[i]);
+		p += buflens[i];
+	}
+	rec->checksum = plog_checksum(rec);
+	*offset = l->tail;
+	plog_setEnd(l, l->tail + PLOG_RECORD_LEN(keyLen, dataLen));
+	__sync_synchronize();               // end marker before the magic, a crash leaves a valid log
+	rec->magic = PLOG_MAGIC;
+	return 0;
+}
+
+
+// rebuilds the index from the log, stops at the first incomplete or damaged record
+static int plog_recover(plogT *l) {
+	size_t offset = 0;
+	char key[256];
+
+	while (offset + sizeof(plogRecord_t) <= l->mapSize) {
+		const plogRecord_t *rec = (const plogRecord_t *)(l->map + offset);
+		plogEntry_t *e,*prev;
+		size_t len;
+
+		if (rec->magic != PLOG_MAGIC) break;
+		len = PLOG_RECORD_LEN((size_t)rec->keyLen, (size_t)rec->dataLen);
+		if (rec->keyLen >= sizeof(key) || offset + len > l->mapSize) break;
+		if (rec->checksum != plog_checksum(rec)) {
+			EPRINTFN("mqtt persistence: checksum error in %s at offset %zu, ignoring the remaining log", l->fileName, offset);
+			break;
+		}
+		memcpy(key, PLOG_KEY(rec), rec->keyLen);
+		key[rec->keyLen] = 0;
+		e = plog_find(l, key, &prev);
+		if (e) plog_unlink(l, e, prev);
+		if (rec->type == PLOG_TYPE_PUT)
+			if (plog_addEntry(l, key, offset) != 0) return -1;
+		offset += len;
+	}
+	plog_setEnd(l, offset);
+	l->p->numRestored += l->numEntries;
+	return 0;
+}
+
+
+// one file per client and server, other characters than alphanumerics are replaced by _
+static char * plog_fileName(const char *directory, const char *clientID, const char *serverURI) {
+	size_t len = strlen(directory) + strlen(clientID) + strlen(serverURI) + sizeof("/--.plog");
+	char *name = malloc(len);
+	char *p;
+
+	if (!name) return NULL;
+	p = name + snprintf(name, len, "%s/", directory);
+	snprintf(p, len - (p - name), "%s-%s.plog", clientID, serverURI);
+	for (; *p && strcmp(p, ".plog") != 0; p++)
+		if (!isalnum((unsigned char)*p) && *p != '-') *p = '_';
+	return name;
+}
+
+
+static int plog_close(void *handle);
+
+static int plog_open(void **handle, const char *clientID, const char *serverURI, void *context) {
+	mqtt_persistenceT *p = (mqtt_persistenceT *)context;
+	plogT *l;
+	struct stat st;
+	size_t size;
+
+	l = calloc(1, sizeof(plogT));
+	if (!l) return MQTTCLIENT_PERSISTENCE_ERROR;
+	l->p = p;
+	l->fileName = plog_fileName(p->directory, clientID, serverURI);
+	if (!l->fileName) { free(l); return MQTTCLIENT_PERSISTENCE_ERROR; }
+	l->fd = open(l->fileName, O_RDWR | O_CREAT, 0600);
+	if (l->fd < 0) {
+		EPRINTFN("mqtt persistence: unable to open %s (%s)", l->fileName, strerror(errno));
+		free(l->fileName);
+		free(l);
+		return MQTTCLIENT_PERSISTENCE_ERROR;
+	}
+	size = MQTT_PERSISTENCE_INITIAL_SIZE;
+	if (fstat(l->fd, &st) == 0 && (size_t)st.st_size > size) size = st.st_size;
+	if (plog_map(l, l->fd, size) != 0 || plog_recover(l) != 0) {
+		plog_close(l);
+		return MQTTCLIENT_PERSISTENCE_ERROR;
+	}
+	if (l->numEntries) {
+		LOGN(0,"mqtt persistence: %d messages in flight restored from %s", l->numEntries, l->fileName);
+	} else
+		VPRINTFN(1,"mqtt persistence: using %s", l->fileName);
+	*handle = l;
+	return 0;
+}
+
+
+static int plog_close(void *handle) {
+	plogT *l = (plogT *)handle;
+
+	if (!l) return 0;
+	plog_freeEntries(l);
+	if (l->map) {
+		msync(l->map, l->mapSize, MS_SYNC);
+		munmap(l->map, l->mapSize);
+	}
+	if (l->fd >= 0) close(l->fd);
+	free(l->fileName);
+	free(l);
+	return 0;
+}
+
+
+static int plog_put(void *handle, char *key, int bufcount, char *buffers[], int buflens[]) {
+	plogT *l = (plogT *)handle;
+	plogEntry_t *e,*prev;
+	size_t offset;
+
+	if (plog_append(l, PLOG_TYPE_PUT, key, bufcount, buffers, buflens, &offset) != 0) return MQTTCLIENT_PERSISTENCE_ERROR;
+	e = plog_find(l, key, &prev);
+	if (e) plog_unlink(l, e, prev);
+	if (plog_addEntry(l, key, offset) != 0) return MQTTCLIENT_PERSISTENCE_ERROR;
+	l->p->numPut++;
+	return 0;
+}
+
+
+static int plog_get(void *handle, char *key, char **buffer, int *buflen) {
+	plogT *l = (plogT *)handle;
+	const plogRecord_t *rec;
+	plogEntry_t *e,*prev;
+
+	e = plog_find(l, key, &prev);
+	if (!e) return MQTTCLIENT_PERSISTENCE_ERROR;
+	rec = (const plogRecord_t *)(l->map + e->offset);
+	*buffer = malloc(rec->dataLen ? rec->dataLen : 1);     // freed by paho
+	if (!*buffer) return MQTTCLIENT_PERSISTENCE_ERROR;
+	memcpy(*buffer, PLOG_DATA(rec), rec->dataLen);
+	*buflen = rec->dataLen;
+	return 0;
+}
+
+
+static int plog_remove(void *handle, char *key) {
+	plogT *l = (plogT *)handle;
+	plogEntry_t *e,*prev;
+	size_t offset;
+
+	e = plog_find(l, key, &prev);
+	if (!e) return MQTTCLIENT_PERSISTENCE_ERROR;
+	plog_unlink(l, e, prev);
+	l->p->numRemoved++;
+	// nothing in flight, start over instead of appending a remove record
+	if (l->numEntries == 0) {
+		plog_setEnd(l, 0);
+		return 0;
+	}
+	if (plog_append(l, PLOG_TYPE_REMOVE, key, 0, NULL, NULL, &offset) != 0) return MQTTCLIENT_PERSISTENCE_ERROR;
+	return 0;
+}
+
+
+static int plog_keys(void *handle, char ***keys, int *nkeys) {
+	plogT *l = (plogT *)handle;
+	plogEntry_t *e;
+	int i = 0;
+
+	*keys = NULL;
+	*nkeys = 0;
+	if (!l->numEntries) return 0;
+	*keys = malloc(l->numEntries * sizeof(char *));     // freed by paho
+	if (!*keys) return MQTTCLIENT_PERSISTENCE_ERROR;
+	for (e = l->entries; e; e = e->next) {
+		(*keys)[i] = strdup(e->key);
+		if (!(*keys)[i]) {
+			while (i) free((*keys)[--i]);
+			free(*keys);
+			*keys = NULL;
+			return MQTTCLIENT_PERSISTENCE_ERROR;
+		}
+		i++;
+	}
+	*nkeys = i;
+	return 0;
+}
+
+
+static int plog_clear(void *handle) {
+	plogT *l = (plogT *)handle;
+
+	plog_freeEntries(l);
+	plog_setEnd(l, 0);
+	return 0;
+}
+
+
+static int plog_containskey(void *handle, char *key) {
+	plogT *l = (plogT *)handle;
+	plogEntry_t *prev;
+
+	return plog_find(l, key, &prev) ? 0 : MQTTCLIENT_PERSISTENCE_ERROR;
+}
+
+
+mqtt_persistenceT * mqtt_persistence_create (const char *directory) {
+	mqtt_persistenceT *p = calloc(1, sizeof(mqtt_persistenceT));
+
+	if (!p) return NULL;
+	p->directory = strdup(directory);
+	if (!p->directory) { free(p); return NULL; }
+	p->paho.context = p;
+	p->paho.popen = plog_open;
+	p->paho.pclose = plog_close;
+	p->paho.pput = plog_put;
+	p->paho.pget = plog_get;
+	p->paho.premove = plog_remove;
+	p->paho.pkeys = plog_keys;
+	p->paho.pclear = plog_clear;
+	p->paho.pcontainskey = plog_containskey;
+	return p;
+}
+
+
+void mqtt_persistence_free (mqtt_persistenceT *p) {
+	if (p) {
+		free(p->directory);
+		free(p);
+	}
+}
+
+
+void mqtt_persistence_logStats (mqtt_persistenceT *p) {
+	LOGN(0,"mqtt persistence: %d stored, %d removed, %d restored, %d compactions",p->numPut,p->numRemoved,p->numRestored,p->numCompactions);
+}
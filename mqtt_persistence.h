@@ -0,0 +1,41 @@
+#ifndef MQTT_PERSISTENCE_H_INCLUDED
+#define MQTT_PERSISTENCE_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "MQTTClientPersistence.h"
+#include <stddef.h>
+
+/*
+  Persistence for the paho MQTTClient, messages in flight are stored in
+  one append-only memory mapped log file per client and server instead of
+  one file per message. Removed messages are appended as remove records,
+  the log is reset once no message is in flight and compacted into a new
+  file if it would need to grow while mostly containing removed messages.
+  Records are checksummed, a partially written record ends the log on
+  recovery.
+*/
+
+#define MQTT_PERSISTENCE_INITIAL_SIZE (64 * 1024)
+
+typedef struct {
+	MQTTClient_persistence paho;    // passed to MQTTClient_createWithOptions, paho copies it
+	char *directory;
+	int numPut;                     // statistics
+	int numRemoved;
+	int numRestored;
+	int numCompactions;
+} mqtt_persistenceT;
+
+// directory has to exist, returns NULL if out of memory
+mqtt_persistenceT * mqtt_persistence_create (const char *directory);
+void mqtt_persistence_free (mqtt_persistenceT *p);
+void mqtt_persistence_logStats (mqtt_persistenceT *p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MQTT_PERSISTENCE_H_INCLUDED
@@ -7,6 +7,7 @@
 #include <stdarg.h>
 #include "log.h"
 #include <unistd.h>
+#include <time.h>
 
 MQTTClient_connectOptions conn_optsDefault = MQTTClient_connectOptions_initializer;
 MQTTClient_createOptions createOpsDefault = MQTTClient_createOptions_initializer;
@@ -38,27 +39,179 @@ mqtt_pubT * mqtt_pub_init (const char * hostname, int port, const char *  client
     m->conn_opts.cleansession = 1;
 	if (clientId) m->clientId = strdup(clientId);
 
+	pthread_mutex_init(&m->lock, NULL);
+	pthread_cond_init(&m->cond, NULL);
+	pthread_cond_init(&m->reconnectCond, NULL);
+	mqtt_pub_setMaxInflight(m, MQTT_DEF_MAX_INFLIGHT);
+	m->mqttVersion = MQTTVERSION_DEFAULT;
+
 	return m;
 }
 
 
 int mqtt_pub_free(mqtt_pubT *m) {
 	if (m) {
+		if (m->reconnectThreadRunning) {
+			pthread_mutex_lock(&m->lock);
+			m->terminate = 1;
+			pthread_cond_signal(&m->reconnectCond);
+			pthread_mutex_unlock(&m->lock);
+			pthread_join(m->reconnectThread, NULL);
+			m->reconnectThreadRunning = 0;
+		}
+		if (m->client && m->subTopic && MQTTClient_isConnected(m->client)) {
+			if (m->mqttVersion == MQTTVERSION_5) {
+				MQTTResponse response = MQTTClient_unsubscribe5(m->client, m->subTopic, NULL);
+				MQTTResponse_free(response);
+			} else
+				MQTTClient_unsubscribe(m->client, m->subTopic);
+		}
+		free(m->subTopic);
 		free(m->clientId);
 		free(m->hostname);
 		free(m->url);
 		free(m->topicPrefix);
+		free(m->topicBuf);
 		if (m->client) {
-			MQTTClient_disconnect(m->client,0);
+			if (m->mqttVersion == MQTTVERSION_5) MQTTClient_disconnect5(m->client,0,MQTTREASONCODE_SUCCESS,NULL);
+			else MQTTClient_disconnect(m->client,0);
 			MQTTClient_destroy(&m->client);
 			m->client = NULL;
 		}
+		mqtt_persistence_free(m->persistence);
+		MQTTProperties_free(&m->pub_props);
+		pthread_mutex_destroy(&m->lock);
+		pthread_cond_destroy(&m->cond);
+		pthread_cond_destroy(&m->reconnectCond);
 		free(m);
 	}
 	return 0;
 }
 
 
+void mqtt_pub_setMaxInflight (mqtt_pubT *m, int maxInflight) {
+	if (maxInflight < 1) maxInflight = 1;
+	m->maxInflight = maxInflight;
+	m->conn_opts.maxInflightMessages = maxInflight;
+}
+
+
+void mqtt_pub_setV5 (mqtt_pubT *m, int messageExpirySecs, int topicAliasMax) {
+	MQTTProperty prop;
+
+	m->mqttVersion = MQTTVERSION_5;
+	m->createOpts.MQTTVersion = MQTTVERSION_5;
+	m->conn_opts.MQTTVersion = MQTTVERSION_5;
+	m->conn_opts.cleansession = 0;		// not allowed for v5
+	m->conn_opts.cleanstart = m->persistence ? 0 : 1;
+	m->messageExpirySecs = messageExpirySecs > 0 ? messageExpirySecs : 0;
+	m->topicAliasMax = topicAliasMax > 0 ? topicAliasMax : 0;
+
+	// [0] message expiry, [1] topic alias, mqtt_pub_send selects the ones needed
+	MQTTProperties_free(&m->pub_props);
+	memset(&prop, 0, sizeof(prop));
+	prop.identifier = MQTTPROPERTY_CODE_MESSAGE_EXPIRY_INTERVAL;
+	prop.value.integer4 = m->messageExpirySecs;
+	MQTTProperties_add(&m->pub_props, &prop);
+	memset(&prop, 0, sizeof(prop));
+	prop.identifier = MQTTPROPERTY_CODE_TOPIC_ALIAS;
+	prop.value.integer2 = 1;
+	MQTTProperties_add(&m->pub_props, &prop);
+}
+
+
+void mqtt_pub_logStats (mqtt_pubT *m) {
+	if (!m) return;
+	pthread_mutex_lock(&m->lock);
+	LOGN(0,"mqtt publish: %lu published, %lu delivered, %d in flight (max %d), %lu waits for a free slot, %lu lost",
+		m->numPublished,m->numDelivered,m->numInflight,m->maxInflight,m->numWindowFull,m->numLost);
+	if (m->persistence) mqtt_persistence_logStats(m->persistence);
+	if (m->reconnectThreadRunning)
+		LOGN(0,"mqtt publish: %sconnected, %lu reconnects, %lu not published while disconnected",m->connected ? "" : "not ",m->numReconnects,m->numNotConnected);
+	if (m->mqttVersion == MQTTVERSION_5)
+		LOGN(0,"mqtt publish: %d topic aliases (broker max %d), %lu rejected by the broker",m->numAliases,m->topicAliasServerMax,m->numReasonErrors);
+	pthread_mutex_unlock(&m->lock);
+}
+
+
+// called by the paho thread when the broker acknowledged a QOS 1/2 message
+static void mqtt_pub_delivered(void *context, MQTTClient_deliveryToken dt) {
+	mqtt_pubT *m = (mqtt_pubT *)context;
+
+	pthread_mutex_lock(&m->lock);
+	if (m->numInflight) m->numInflight--;
+	m->numDelivered++;
+	pthread_cond_signal(&m->cond);
+	pthread_mutex_unlock(&m->lock);
+}
+
+
+// clean session, messages in flight will not be acknowledged
+static void mqtt_pub_connlost(void *context, char *cause) {
+	mqtt_pubT *m = (mqtt_pubT *)context;
+
+	pthread_mutex_lock(&m->lock);
+	// persisted messages are resent after the reconnect and will be acknowledged
+	if (!m->persistence) {
+		m->numLost += m->numInflight;
+		m->numInflight = 0;
+		pthread_cond_broadcast(&m->cond);
+	}
+	m->connected = 0;
+	pthread_cond_signal(&m->reconnectCond);
+	pthread_mutex_unlock(&m->lock);
+	VPRINTFN(1,"mqtt publisher: connection lost");
+}
+
+
+// v5: called when the broker acknowledged a QOS 1/2 message, failures are reported as reason code
+static void mqtt_pub_published(void *context, int dt, int packet_type, MQTTProperties *properties, enum MQTTReasonCodes reasonCode) {
+	mqtt_pubT *m = (mqtt_pubT *)context;
+
+	if (reasonCode >= MQTTREASONCODE_UNSPECIFIED_ERROR) {
+		pthread_mutex_lock(&m->lock);
+		m->numReasonErrors++;
+		pthread_mutex_unlock(&m->lock);
+		VPRINTFN(1,"mqtt publish rejected by the broker: %s (%d)",MQTTReasonCode_toString(reasonCode),reasonCode);
+	}
+}
+
+
+// v5: disconnect sent by the broker, e.g. for an invalid topic alias
+static void mqtt_pub_disconnected(void *context, MQTTProperties *properties, enum MQTTReasonCodes reasonCode) {
+	LOGN(0,"mqtt publisher disconnected by the broker: %s (%d)",MQTTReasonCode_toString(reasonCode),reasonCode);
+}
+
+
+// we do not subscribe with this client but paho requires the callback
+static int mqtt_pub_msgarrvd(void *context, char *topicName, int topicLen, MQTTClient_message *message) {
+	mqtt_pubT *m = (mqtt_pubT *)context;
+
+	if (m->onMessage) return m->onMessage(context, topicName, topicLen, message);
+	MQTTClient_freeMessage(&message);
+	MQTTClient_free(topicName);
+	return 1;
+}
+
+
+// restored or resent messages occupy in-flight slots until acknowledged, messages dropped by paho
+// on a connection loss would otherwise never release their slot
+static void mqtt_pub_syncInflight(mqtt_pubT *m) {
+	MQTTClient_deliveryToken *tokens = NULL;
+	int numPending = 0;
+
+	if (MQTTClient_getPendingDeliveryTokens(m->client, &tokens) == MQTTCLIENT_SUCCESS && tokens) {
+		while (tokens[numPending] != -1) numPending++;
+		MQTTClient_free(tokens);
+	}
+	pthread_mutex_lock(&m->lock);
+	if (m->numInflight > numPending) m->numLost += m->numInflight - numPending;
+	m->numInflight = numPending;
+	pthread_cond_broadcast(&m->cond);
+	pthread_mutex_unlock(&m->lock);
+}
+
+
 #define URL_DEFBUFLEN 64
 
 int mqtt_pub_connect (mqtt_pubT *m) {
@@ -79,13 +232,80 @@ int mqtt_pub_connect (mqtt_pubT *m) {
 	//printf("url: '%s' %d %d\n",m->url,urlBufLen,urlLen);
 
 	if (m->client == NULL) {
-		rc = MQTTClient_create(&m->client, m->url, m->clientId, MQTTCLIENT_PERSISTENCE_NONE, NULL);
+		if (m->persistence)
+			rc = MQTTClient_createWithOptions(&m->client, m->url, m->clientId, MQTTCLIENT_PERSISTENCE_USER, &m->persistence->paho, &m->createOpts);
+		else
+			rc = MQTTClient_createWithOptions(&m->client, m->url, m->clientId, MQTTCLIENT_PERSISTENCE_NONE, NULL, &m->createOpts);
 		if (rc != MQTTCLIENT_SUCCESS) return rc;
+		if (m->persistence) mqtt_pub_syncInflight(m);
 		//printf("Client created\n");
+		// with callbacks set, publish does not block until the message is acknowledged
+		rc = MQTTClient_setCallbacks(m->client, m, mqtt_pub_connlost, mqtt_pub_msgarrvd, mqtt_pub_delivered);
+		if (rc != MQTTCLIENT_SUCCESS) return rc;
+		if (m->mqttVersion == MQTTVERSION_5) {
+			MQTTClient_setPublished(m->client, m, mqtt_pub_published);
+			MQTTClient_setDisconnected(m->client, m, mqtt_pub_disconnected);
+		}
 	}
 	if (!MQTTClient_isConnected(m->client)) {		// connect if not already connected
-		rc = MQTTClient_connect(m->client, &m->conn_opts);
+		// the configured value, may be limited by the broker on each connect
+		int maxInflight = m->conn_opts.maxInflightMessages;
+
+		if (m->mqttVersion == MQTTVERSION_5) {
+			MQTTProperties connectProps = MQTTProperties_initializer;
+			if (m->persistence) {
+				// without a session expiry interval the broker discards the session on disconnect
+				MQTTProperty prop;
+				memset(&prop, 0, sizeof(prop));
+				prop.identifier = MQTTPROPERTY_CODE_SESSION_EXPIRY_INTERVAL;
+				prop.value.integer4 = MQTT_SESSION_EXPIRY_SECS;
+				MQTTProperties_add(&connectProps, &prop);
+			}
+			MQTTResponse response = MQTTClient_connect5(m->client, &m->conn_opts, &connectProps, NULL);
+			MQTTProperties_free(&connectProps);
+			rc = response.reasonCode;
+			m->topicAliasServerMax = 0;
+			if (rc == MQTTREASONCODE_SUCCESS && response.properties) {
+				// topic aliases and in-flight messages are limited by the broker
+				if (MQTTProperties_hasProperty(response.properties, MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM))
+					m->topicAliasServerMax = MQTTProperties_getNumericValue(response.properties, MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM);
+				if (m->topicAliasServerMax > m->topicAliasMax) m->topicAliasServerMax = m->topicAliasMax;
+				if (MQTTProperties_hasProperty(response.properties, MQTTPROPERTY_CODE_RECEIVE_MAXIMUM)) {
+					int receiveMax = MQTTProperties_getNumericValue(response.properties, MQTTPROPERTY_CODE_RECEIVE_MAXIMUM);
+					if (receiveMax > 0 && receiveMax < maxInflight) {
+						LOGN(0,"mqtt publisher: max in flight limited to %d by the broker",receiveMax);
+						maxInflight = receiveMax;
+					}
+				}
+			}
+			if (rc != MQTTREASONCODE_SUCCESS && rc > 0) LOGN(0,"mqtt publisher: connect failed: %s (%d)",MQTTReasonCode_toString(response.reasonCode),rc);
+			MQTTResponse_free(response);
+		} else
+			rc = MQTTClient_connect(m->client, &m->conn_opts);
 		if (rc != MQTTCLIENT_SUCCESS) return rc;
+		pthread_mutex_lock(&m->lock);
+		m->maxInflight = maxInflight;
+		pthread_cond_broadcast(&m->cond);
+		pthread_mutex_unlock(&m->lock);
+		if (m->persistence) mqtt_pub_syncInflight(m);
+		m->connGen++;
+		m->numAliases = 0;
+		if (m->subTopic) {
+			if (m->mqttVersion == MQTTVERSION_5) {
+				// reason code is the granted QOS on success
+				MQTTResponse response = MQTTClient_subscribe5(m->client, m->subTopic, m->subQos, NULL, NULL);
+				rc = response.reasonCode;
+				MQTTResponse_free(response);
+				if (rc >= 0 && rc < MQTTREASONCODE_UNSPECIFIED_ERROR) rc = MQTTCLIENT_SUCCESS;
+			} else
+				rc = MQTTClient_subscribe(m->client, m->subTopic, m->subQos);
+			if (rc != MQTTCLIENT_SUCCESS) {
+				EPRINTFN("mqtt: failed to subscribe to \"%s\", rc: %d",m->subTopic,rc);
+				MQTTClient_disconnect(m->client, 0);
+				return rc;
+			}
+			LOGN(0,"subscribed to \"%s\", QOS: %d",m->subTopic,m->subQos);
+		}
 	}
 	return 0;
 }
@@ -93,43 +313,285 @@ int mqtt_pub_connect (mqtt_pubT *m) {
 int isDisconnected;
 
 int mqtt_pub (mqtt_pubT *m, char *topicIn, char *str, int timeoutMs, int qos, int retained) {
-	MQTTClient_message pubmsg = pubmsgDefault;
+	char *topic;
+	int topicLen, prefixLen = 0;
+
+	topicLen = strlen(topicIn);
+	if (m->topicPrefix) prefixLen = strlen(m->topicPrefix);
+	if (prefixLen + topicLen + 1 > m->topicBufSize) {
+		topic = realloc(m->topicBuf, prefixLen + topicLen + 1);
+		if (!topic) return -1;
+		m->topicBuf = topic;
+		m->topicBufSize = prefixLen + topicLen + 1;
+	}
+	topic = m->topicBuf;
+	if (prefixLen) memcpy(topic,m->topicPrefix,prefixLen);
+	memcpy(topic+prefixLen,topicIn,topicLen+1);
+	return mqtt_pub_len(m, topic, str, strlen(str), timeoutMs, qos, retained);
+}
+
+
+int mqtt_pub_setPersistence (mqtt_pubT *m, const char *directory) {
+	mqtt_persistence_free(m->persistence);
+	m->persistence = mqtt_persistence_create(directory);
+	if (!m->persistence) return -1;
+	// paho removes persisted messages on connect with a clean session
+	m->conn_opts.cleansession = 0;
+	m->conn_opts.cleanstart = 0;
+	return 0;
+}
+
+
+int mqtt_pub_setSubscription (mqtt_pubT *m, const char *topic, int qos, MQTTClient_messageArrived *onMessage) {
+	free(m->subTopic);
+	m->subTopic = strdup(topic);
+	if (!m->subTopic) return -1;
+	m->subQos = qos;
+	m->onMessage = onMessage;
+	return 0;
+}
+
+
+int mqtt_pub_isConnected (mqtt_pubT *m) {
+	int connected;
+
+	if (!m->reconnectThreadRunning) return m->client && MQTTClient_isConnected(m->client);
+	pthread_mutex_lock(&m->lock);
+	connected = m->connected;
+	pthread_mutex_unlock(&m->lock);
+	return connected;
+}
+
+
+// waits for a lost connection and reconnects with exponential backoff
+static void * mqtt_pub_reconnectThreadFunc(void *arg) {
+	mqtt_pubT *m = (mqtt_pubT *)arg;
+	int backoffSecs = 1;
+	int isFirst = 1;
+	struct timespec ts;
+	int rc;
+
+	pthread_mutex_lock(&m->lock);
+	while (!m->terminate) {
+		if (m->connected) {
+			pthread_cond_wait(&m->reconnectCond, &m->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&m->lock);
+		rc = mqtt_pub_connect(m);
+		pthread_mutex_lock(&m->lock);
+		if (rc == MQTTCLIENT_SUCCESS) {
+			m->connected = 1;
+			backoffSecs = 1;
+			if (isFirst) {
+				LOGN(0,"connected to mqtt server %s",m->url);
+			} else {
+				m->numReconnects++;
+				LOGN(0,"reconnected to mqtt server %s",m->url);
+			}
+			isFirst = 0;
+			continue;
+		}
+		VPRINTFN(1,"mqtt connect to %s failed, rc: %d, next attempt in %d seconds",m->url,rc,backoffSecs);
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += backoffSecs;
+		while (!m->terminate && pthread_cond_timedwait(&m->reconnectCond, &m->lock, &ts) == 0);
+		backoffSecs *= 2;
+		if (backoffSecs > MQTT_RECONNECT_BACKOFF_MAX_SECS) backoffSecs = MQTT_RECONNECT_BACKOFF_MAX_SECS;
+	}
+	pthread_mutex_unlock(&m->lock);
+	return NULL;
+}
+
+
+int mqtt_pub_startReconnectThread (mqtt_pubT *m) {
+	if (m->reconnectThreadRunning) return 0;
+	m->terminate = 0;
+	if (pthread_create(&m->reconnectThread, NULL, mqtt_pub_reconnectThreadFunc, m) != 0) {
+		EPRINTFN("mqtt: failed to create reconnect thread");
+		return -1;
+	}
+	m->reconnectThreadRunning = 1;
+	return 0;
+}
+
+
+// reserves an in-flight slot, waits up to timeoutMs if all slots are in use
+static int mqtt_pub_reserveSlot(mqtt_pubT *m, int timeoutMs) {
+	struct timespec ts;
+	int rc = 0;
+
+	pthread_mutex_lock(&m->lock);
+	if (m->numInflight >= m->maxInflight) {
+		m->numWindowFull++;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += timeoutMs / 1000;
+		ts.tv_nsec += (long)(timeoutMs % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) { ts.tv_sec++; ts.tv_nsec -= 1000000000; }
+		while (m->numInflight >= m->maxInflight && rc == 0)
+			rc = pthread_cond_timedwait(&m->cond, &m->lock, &ts);
+	}
+	if (m->numInflight < m->maxInflight) {
+		m->numInflight++;
+		rc = 0;
+	} else
+		rc = MQTTCLIENT_MAX_MESSAGES_INFLIGHT;
+	pthread_mutex_unlock(&m->lock);
+	return rc;
+}
+
+
+static void mqtt_pub_releaseSlot(mqtt_pubT *m) {
+	pthread_mutex_lock(&m->lock);
+	if (m->numInflight) m->numInflight--;
+	pthread_cond_signal(&m->cond);
+	pthread_mutex_unlock(&m->lock);
+}
+
+
+static int mqtt_pub_msg (mqtt_pubT *m, const char *topic, mqtt_topicT *alias, const char *payload, int payloadLen, int timeoutMs, int qos, int retained);
+
+// publishes with the v5 properties if enabled, a topic alias is used after the topic has been sent once with the alias
+static int mqtt_pub_send(mqtt_pubT *m, const char *topic, mqtt_topicT *alias, MQTTClient_message *pubmsg) {
+	MQTTResponse response;
+	MQTTProperties *props = &pubmsg->properties;
+	int newAlias = 0;
 	int rc;
+
+	if (m->mqttVersion != MQTTVERSION_5)
+		return MQTTClient_publishMessage(m->client, topic, pubmsg, &m->last_token);
+
+	// references the preallocated properties, no allocation per publish
+	*props = m->pub_props;
+	props->count = 0;
+	props->length = 0;
+	if (m->messageExpirySecs) {
+		props->count++;
+		props->length += 5;		// identifier + four byte integer
+	} else
+		props->array++;
+	// persisted messages may be resent on a new connection where the alias is not valid
+	if (pubmsg->qos > 0 && m->persistence) alias = NULL;
+	if (alias && m->topicAliasServerMax) {
+		if (alias->alias && alias->connGen == m->connGen) {
+			if (!alias->remap) topic = "";		// else the alias is assigned to the new topic
+		} else if (m->numAliases < m->topicAliasServerMax) {
+			newAlias = m->numAliases + 1;		// sent with the topic to assign the alias
+		}
+		if (topic[0] == 0 || newAlias || (alias->remap && alias->alias && alias->connGen == m->connGen)) {
+			m->pub_props.array[1].value.integer2 = newAlias ? newAlias : alias->alias;
+			props->count++;
+			props->length += 3;	// identifier + two byte integer
+		}
+	}
+	response = MQTTClient_publishMessage5(m->client, topic, pubmsg, &m->last_token);
+	rc = response.reasonCode;
+	MQTTResponse_free(response);
+	if (rc >= MQTTREASONCODE_UNSPECIFIED_ERROR) {
+		VPRINTFN(1,"mqtt publish to %s failed: %s (%d)",topic[0] ? topic : "topic alias",MQTTReasonCode_toString(rc),rc);
+		pthread_mutex_lock(&m->lock);
+		m->numReasonErrors++;
+		pthread_mutex_unlock(&m->lock);
+	} else if (rc >= 0) {
+		rc = MQTTCLIENT_SUCCESS;	// e.g. no matching subscribers
+		if (alias) alias->remap = 0;
+		if (newAlias) {
+			alias->alias = newAlias;
+			alias->connGen = m->connGen;
+			m->numAliases = newAlias;
+		}
+	}
+	return rc;
+}
+
+
+int mqtt_topic_set (mqtt_topicT *t, const char *prefix, const char *name) {
+	int prefixLen,nameLen;
 	char *topic;
-	int topicLen;
+
+	if (t->topic && t->prefix == prefix && t->name == name) return 0;
+	prefixLen = prefix ? strlen(prefix) : 0;
+	nameLen = name ? strlen(name) : 0;
+	topic = malloc(prefixLen + nameLen + 1);
+	if (!topic) return -1;
+	if (prefixLen) memcpy(topic, prefix, prefixLen);
+	if (nameLen) memcpy(topic + prefixLen, name, nameLen);
+	topic[prefixLen + nameLen] = 0;
+	if (t->topic) t->remap = 1;		// keep the alias number
+	free(t->topic);
+	t->topic = topic;
+	t->topicLen = prefixLen + nameLen;
+	t->prefix = prefix;
+	t->name = name;
+	return 1;
+}
+
+
+void mqtt_topic_free (mqtt_topicT *t) {
+	free(t->topic);
+	memset(t, 0, sizeof(*t));
+}
+
+
+int mqtt_pub_len (mqtt_pubT *m, const char *topic, const char *payload, int payloadLen, int timeoutMs, int qos, int retained) {
+	return mqtt_pub_msg(m, topic, NULL, payload, payloadLen, timeoutMs, qos, retained);
+}
+
+
+int mqtt_pub_topic (mqtt_pubT *m, mqtt_topicT *t, const char *payload, int payloadLen, int timeoutMs, int qos, int retained) {
+	return mqtt_pub_msg(m, t->topic, t, payload, payloadLen, timeoutMs, qos, retained);
+}
+
+
+static int mqtt_pub_msg (mqtt_pubT *m, const char *topic, mqtt_topicT *alias, const char *payload, int payloadLen, int timeoutMs, int qos, int retained) {
+	MQTTClient_message pubmsg = pubmsgDefault;
+	int rc;
 	int reconnected = 0;
 
-	topicLen = strlen(topicIn);
-	if (m->topicPrefix) topicLen += strlen(m->topicPrefix);
-	topic = malloc(topicLen+1);
-	*topic = 0;
-	if (m->topicPrefix) strcpy(topic,m->topicPrefix);
-	strcat(topic,topicIn);
-
-	pubmsg.payload = str;
-	pubmsg.payloadlen = strlen(str);
+	// reconnects are done by the reconnect thread, do not wait for it
+	if (m->reconnectThreadRunning && !mqtt_pub_isConnected(m)) {
+		pthread_mutex_lock(&m->lock);
+		m->numNotConnected++;
+		pthread_mutex_unlock(&m->lock);
+		return MQTTCLIENT_DISCONNECTED;
+	}
+
+	// QOS 0 messages are not acknowledged
+	if (qos > 0) {
+		rc = mqtt_pub_reserveSlot(m, timeoutMs);
+		if (rc != 0) return rc;
+	}
+
+	pubmsg.payload = (void *)payload;
+	pubmsg.payloadlen = payloadLen;
 	pubmsg.qos = qos;	// 0=Fire and forget - the message may not be delivered,
 	pubmsg.retained = retained;
-	rc = MQTTClient_publishMessage(m->client, topic, &pubmsg, &m->last_token);
-	if (rc == MQTTCLIENT_DISCONNECTED) {		// try to reconnect
+	rc = mqtt_pub_send(m, topic, alias, &pubmsg);
+	if (rc == MQTTCLIENT_DISCONNECTED && m->reconnectThreadRunning) {
+		pthread_mutex_lock(&m->lock);
+		m->connected = 0;
+		m->numNotConnected++;
+		pthread_cond_signal(&m->reconnectCond);
+		pthread_mutex_unlock(&m->lock);
+	} else if (rc == MQTTCLIENT_DISCONNECTED) {		// try to reconnect
 		if (!isDisconnected) EPRINTFN("MQTTClient_publishMessage returned MQTTCLIENT_DISCONNECTED, trying to reconnect");
 		isDisconnected = 1;
 		rc = mqtt_pub_connect(m);
-		if (rc != MQTTCLIENT_SUCCESS) {
-			free(topic);
-			return rc;
-		}
-		rc = MQTTClient_publishMessage(m->client, topic, &pubmsg, &m->last_token);
+		if (rc == MQTTCLIENT_SUCCESS) rc = mqtt_pub_send(m, topic, alias, &pubmsg);
 		if (rc == MQTTCLIENT_SUCCESS) {
 			reconnected++;
 			isDisconnected = 0;
 			LOGN(0,"reconnected to mqtt server");
 		}
 	}
-	free(topic);
-	if (rc != MQTTCLIENT_SUCCESS && rc != MQTT_RECONNECTED) return rc;
-	if (timeoutMs) rc = MQTTClient_waitForCompletion(m->client, m->last_token, timeoutMs);
-	if (reconnected && rc == MQTTCLIENT_SUCCESS) rc = MQTT_RECONNECTED;
+	if (rc != MQTTCLIENT_SUCCESS) {
+		if (qos > 0) mqtt_pub_releaseSlot(m);
+		return rc;
+	}
+	pthread_mutex_lock(&m->lock);
+	m->numPublished++;
+	pthread_mutex_unlock(&m->lock);
+	if (reconnected) rc = MQTT_RECONNECTED;
 	return rc;
 }
 
@@ -8,23 +8,77 @@ extern "C" {
 
 #include "MQTTClient.h"
 #include "MQTTClientPersistence.h"
+#include "mqtt_persistence.h"
+#include <pthread.h>
 
 #define MQTT_RECONNECTED -9989864
+#define MQTT_DEF_MAX_INFLIGHT 20
+#define MQTT_DEF_TOPIC_ALIAS_MAX 1000
+#define MQTT_RECONNECT_BACKOFF_MAX_SECS 60
+#define MQTT_SESSION_EXPIRY_SECS 86400      // v5 with persistence, session kept by the broker after a disconnect
 
+// full topic built once by mqtt_topic_set, rebuilt only if prefix or name changes
+typedef struct {
+	char *topic;            // prefix + name
+	int topicLen;
+	const char *prefix;     // strings the topic has been built from, compared by address
+	const char *name;
+	// MQTT v5 topic alias, valid for the connection it was assigned on
+	int alias;              // 0 if not assigned
+	int connGen;            // mqtt_pubT.connGen at the time alias was assigned
+	int remap;              // topic changed, has to be sent once with the alias
+} mqtt_topicT;
 
 typedef struct {
 	char *clientId;
 	char *hostname;
 	char *topicPrefix;
 	int lastBufSize;
+	char *topicBuf;   // prefix + topic, kept between publishes
+	int topicBufSize;
 	int port;
 	char *url;  // will be created in mqtt_pub_connect
 	MQTTClient client;
-	MQTTProperties pub_props;
+	MQTTProperties pub_props;   // v5: message expiry and topic alias, preallocated, values set per publish
 	MQTTClient_createOptions createOpts;
 	MQTTClient_deliveryToken last_token;
 	MQTTClient_connectOptions conn_opts;
 
+	// publishes with QOS > 0 do not wait for the broker, the number of
+	// unacknowledged messages is limited to maxInflight
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int maxInflight;
+	int numInflight;
+	unsigned long numPublished;     // statistics
+	unsigned long numDelivered;
+	unsigned long numWindowFull;    // publishes that had to wait for a free slot
+	unsigned long numLost;          // in flight while the connection was lost
+
+	// MQTT v5
+	int mqttVersion;
+	int messageExpirySecs;  // 0=off
+	int topicAliasMax;      // max aliases to use, limited by the broker
+	int topicAliasServerMax;// from CONNACK, 0 if aliases are not supported
+	int numAliases;         // aliases assigned on the current connection
+	int connGen;            // incremented on each connect, invalidates topic aliases
+	unsigned long numReasonErrors;  // publishes rejected by the broker with a reason code
+
+	// optional subscription, (re)subscribed on each connect
+	char *subTopic;
+	int subQos;
+	MQTTClient_messageArrived *onMessage;
+
+	// reconnect state machine, if the thread is running publishes never block for a reconnect
+	pthread_t reconnectThread;
+	pthread_cond_t reconnectCond;
+	int reconnectThreadRunning;
+	int connected;          // set by the reconnect thread after connect and subscribe
+	int terminate;
+	unsigned long numReconnects;
+	unsigned long numNotConnected;  // publishes dropped while not connected
+
+	mqtt_persistenceT *persistence;    // NULL=messages in flight are lost on restart
 } mqtt_pubT;
 
 
@@ -36,8 +90,41 @@ int mqtt_pub_free(mqtt_pubT *m);
 
 int mqtt_pub_connect (mqtt_pubT *m);
 
+// max number of unacknowledged QOS 1/2 messages, has to be called before mqtt_pub_connect
+void mqtt_pub_setMaxInflight (mqtt_pubT *m, int maxInflight);
+
+// use MQTT v5 with the given message expiry (0=off) and max number of topic aliases (0=off), has to be called before mqtt_pub_connect
+void mqtt_pub_setV5 (mqtt_pubT *m, int messageExpirySecs, int topicAliasMax);
+
+void mqtt_pub_logStats (mqtt_pubT *m);
+
+// stores messages in flight in directory, they are resent after a reconnect or restart
+// the session is not cleaned on connect, has to be called before mqtt_pub_connect
+int mqtt_pub_setPersistence (mqtt_pubT *m, const char *directory);
+
+// subscribes to topic on each connect, onMessage has to free the message and topic as with MQTTClient_setCallbacks
+// has to be called before mqtt_pub_connect
+int mqtt_pub_setSubscription (mqtt_pubT *m, const char *topic, int qos, MQTTClient_messageArrived *onMessage);
+
+// connects and reconnects with backoff in a background thread
+int mqtt_pub_startReconnectThread (mqtt_pubT *m);
+int mqtt_pub_isConnected (mqtt_pubT *m);
+
 int mqtt_pub (mqtt_pubT *m, char *topic, char *str, int timeoutMs, int qos, int retained);
 
+// topic is used as is (topicPrefix is not applied), no allocations
+// returns without waiting for the broker, timeoutMs is the max time to wait for a free in-flight slot
+int mqtt_pub_len (mqtt_pubT *m, const char *topic, const char *payload, int payloadLen, int timeoutMs, int qos, int retained);
+
+// builds the topic if not yet done or if prefix or name differ from the ones used before
+// prefix and name are compared by address and have to be kept unchanged while in use
+// returns 1 if the topic has been (re)built, 0 if unchanged, -1 if out of memory
+int mqtt_topic_set (mqtt_topicT *t, const char *prefix, const char *name);
+void mqtt_topic_free (mqtt_topicT *t);
+
+// as mqtt_pub_len for a prebuilt topic, with MQTT v5 the topic is replaced by a topic alias after the first publish
+int mqtt_pub_topic (mqtt_pubT *m, mqtt_topicT *t, const char *payload, int payloadLen, int timeoutMs, int qos, int retained);
+
 // printf formatting
 int mqtt_pub_strF (mqtt_pubT *m, char *topic, int timeoutMs, int qos, int retained, const char *fmt, ...);
 
@@ -6,6 +6,7 @@
 #include "MQTTClient.h"
 #include "cJSON.h"
 #include <ctype.h>
+#include <stdio.h>
 #include <math.h>
 #include <time.h>
 #include <pthread.h>
@@ -13,6 +14,7 @@
 nameMappings_t *nameMappings;
 unmappedDevices_t *unmappedDevices;
 dataRead_t *mqttDataRead;
+influxPending_t influxPending;
 MQTTClient client;
 
 int mqttReceiver_isConnected() {
@@ -179,6 +181,115 @@ int64_t getIntFromHex(char **work, int *remaining, int bytes, int isSigned) {
   "data": "020106 1BFF9904 050F0A53E6C3CC0010FFE40418B196940D3FF0661B4D4621"
 */
 
+void fieldStats_add(fieldStats_t *s, double v) {
+	double delta;
+
+	if (!s->count || v < s->min) s->min = v;
+	if (!s->count || v > s->max) s->max = v;
+	s->count++;
+	delta = v - s->mean;
+	s->mean += delta / s->count;
+	s->m2 += delta * (v - s->mean);
+	s->last = v;
+}
+
+
+double fieldStats_get(const fieldStats_t *s, statKind_t kind) {
+	switch (kind) {
+		case stat_last: return s->last;
+		case stat_min: return s->min;
+		case stat_max: return s->max;
+		case stat_mean: return s->mean;
+		case stat_stddev: return s->count > 1 ? sqrt(s->m2 / (s->count - 1)) : 0;
+		case stat_count: return s->count;
+		default: return 0;
+	}
+}
+
+
+// the fields selectable by influxfields and influxrollup
+static void deviceStatsAdd(fieldStats_t *stats, double temperature, double humidity, int pressure, int batteryVoltage, int rssi) {
+    fieldStats_add(&stats[stats_temp],temperature);
+    fieldStats_add(&stats[stats_humidity],humidity);
+    fieldStats_add(&stats[stats_pressure],pressure);
+    fieldStats_add(&stats[stats_batt],(double)batteryVoltage / 1000);
+    fieldStats_add(&stats[stats_rssi],rssi);
+}
+
+
+static dataRead_t * deviceCreate(int64_t macAddress, nameMappings_t *nm) {
+    dataRead_t *dr = (dataRead_t *)calloc(1,sizeof(dataRead_t));
+
+    dr->mac = macAddress;
+    snprintf(dr->macStr,sizeof(dr->macStr),"%012lX",macAddress);
+    if (nm) dr->name = nm->name;
+    dr->pubIntervalMs = -1;
+    if (influxNumTiers) dr->tierData = (influxTierData_t *)calloc(influxNumTiers,sizeof(influxTierData_t));
+    if (accelRingSize && accelRing_init(&dr->accel,accelRingSize) != 0) EPRINTFN("out of memory, acceleration of %s not recorded",dr->macStr);
+    return dr;
+}
+
+
+static int derivedRealloc(double **a, int size) {
+    double *p = (double *)realloc(*a,size * sizeof(double));
+
+    if (!p) return -1;
+    *a = p;
+    return 0;
+}
+
+
+static int derivedBatchResize(int size) {
+    dataRead_t **dr;
+
+    if (size < 16) size = 16;
+    dr = (dataRead_t **)realloc(derivedBatch.dr,size * sizeof(dataRead_t *));
+    if (!dr) return -1;
+    derivedBatch.dr = dr;
+    if (derivedRealloc(&derivedBatch.temp,size) != 0 || derivedRealloc(&derivedBatch.humidity,size) != 0) return -1;
+    for (int m=0;m<derived_numMetrics;m++)
+        if (derivedRealloc(&derivedBatch.values[m],size) != 0) return -1;
+    derivedBatch.size = size;
+    return 0;
+}
+
+
+// every accepted sample is added, the stats of the derived metrics are updated in the order received
+static void derivedBatchAdd(dataRead_t *dr, double temperature, double humidity) {
+    derivedBatch_t *b = &derivedBatch;
+
+    if (b->n >= b->size && derivedBatchResize(b->size * 2) != 0) {
+        EPRINTFN("out of memory");
+        exit(1);
+    }
+    b->dr[b->n] = dr;
+    b->temp[b->n] = temperature;
+    b->humidity[b->n] = humidity < DERIVED_HUMIDITY_MIN ? DERIVED_HUMIDITY_MIN : humidity;
+    b->n++;
+}
+
+
+// current time for the acceleration samples, the gateway timestamp has a resolution of one second
+static uint64_t nowMsRealtime() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+// 1 if one of the enabled fields is an outlier, all fields are added to their window
+static int spikeFilterCheck(dataRead_t *dr, double temperature, double humidity, int pressure) {
+    double v[spike_numFields] = {temperature,humidity,(double)pressure};
+    int spike = 0;
+
+    for (int i=0;i<spike_numFields;i++)
+        if (spikeFilter.enabled[i] && spikeFilter_add(&dr->spikeWindow[i],spikeFilter.windowSize,v[i],spikeFilter.threshold,spikeFilter.minDeviation[i]))
+            spike = 1;
+    return spike;
+}
+
+
 #define SKIP(BYTES) remaining-=BYTES*2; work+=BYTES*2
 int processRuuviData(char * data, int rssi) {
     int len;
@@ -187,6 +298,7 @@ int processRuuviData(char * data, int rssi) {
     int i,dataFormat;
     double temperature, humidity, deltaTemperature, deltaHumidity;
     int pressure,deltaPressure,batteryVoltage,txpower,movementCounter,measurementSequence,deltaRssi;
+    int accelX,accelY,accelZ;
     int64_t macAddress;
     dataRead_t *dr;
     nameMappings_t *nm;
@@ -230,9 +342,9 @@ int processRuuviData(char * data, int rssi) {
             humidity = (double)getIntFromHex(&work,&remaining,2,false) * 0.0025;
             pressure = getIntFromHex(&work,&remaining,2,false);
             if (pressure == 0xffff) pressure = 0; else pressure += 50000;
-            SKIP(2);    // Acceleration-Y
-            SKIP(2);    // Acceleration-X
-            SKIP(2);    // Acceleration-Z
+            accelX = (int16_t)getIntFromHex(&work,&remaining,2,false);    // mG, two's complement, 0x8000 = invalid
+            accelY = (int16_t)getIntFromHex(&work,&remaining,2,false);
+            accelZ = (int16_t)getIntFromHex(&work,&remaining,2,false);
             i = getIntFromHex(&work,&remaining,2,false);
             batteryVoltage = (i >> 5) + 1600;
             if ((i & 0x01f) == 0b11111) txpower = 0; else txpower = -40 + ((i  & 0x01f) * 2);
@@ -251,25 +363,23 @@ int processRuuviData(char * data, int rssi) {
     // add or update in mqttDataRead
     dr = mqttDataRead;
     if (! dr) {
-        dr = (dataRead_t *)calloc(1,sizeof(dataRead_t));
+        dr = deviceCreate(macAddress, nm);
         mqttDataRead = dr;
-        dr->mac = macAddress;
-        if (nm) dr->name = nm->name;
-        dr->dataInflux.temperature = -999;
-        dr->dataInflux.humidity = -999;
     } else {
         while (dr->mac != macAddress) {
             if (dr->next) dr = dr->next;
             else {
-                dr->next = (dataRead_t *)calloc(1,sizeof(dataRead_t));
-                dr->next->mac = macAddress;
+                dr->next = deviceCreate(macAddress, nm);
                 dr = dr->next;
-                if (nm) dr->name = nm->name;
-                dr->dataInflux.temperature = -999;
-                dr->dataInflux.humidity = -999;
             }
         }
     }
+    if (spikeFilter.windowSize && measurementSequence != dr->dataCurr.measurementSequence && spikeFilterCheck(dr,temperature,humidity,pressure)) {
+        dr->spikeNumRejected++;
+        dr->dataCurr.measurementSequence = measurementSequence;    // the same sample received by another gateway is ignored as well
+        LOGN(1,"%012lx (%s): sample rejected by spike filter, temp: %5.2f, humidity: %6.3f, pressure: %6d, seq: %d",macAddress,nm!=NULL?nm->name:NULL,temperature,humidity,pressure,measurementSequence);
+        return true;
+    }
     // set values in dr
     free (dr->rawData); dr->rawData = strdup(data);
     deltaTemperature = temperature-dr->dataCurr.temperature;
@@ -285,18 +395,24 @@ int processRuuviData(char * data, int rssi) {
     dr->dataCurr.rssi = rssi;
     if (measurementSequence != dr->dataCurr.measurementSequence) {
         dr->updated++;
-        // average temp for influx
-        //if (dr->dataInflux.temperature < -900) dr->dataInflux.temperature = temperature; else { dr->dataInflux.temperature += temperature; dr->dataInflux.temperature = dr->dataInflux.temperature / 2; }
-        // AD 01/2025: do not avg
-        dr->dataInflux.temperature = temperature;
-        VPRINTFN(3," temperature: %5.3f dataInflux.temperature: %5.3f",temperature,dr->dataInflux.temperature);
-        // max humidity for influx
-        if (humidity > dr->dataInflux.humidity) dr->dataInflux.humidity = humidity;
-        dr->dataInflux.rssi = rssi;
-        dr->dataInflux.batteryVoltage = batteryVoltage;
+        // the influx fields (last, min, max ...) are selected by influxfields
+        deviceStatsAdd(dr->influxStats,temperature,humidity,pressure,batteryVoltage,rssi);
+        if (dr->tierData)
+            for (i=0;i<influxNumTiers;i++) deviceStatsAdd(dr->tierData[i].stats,temperature,humidity,pressure,batteryVoltage,rssi);
+        if (dr->accel.samples && accelX != -32768 && accelY != -32768 && accelZ != -32768)
+            accelRing_add(&dr->accel,nowMsRealtime(),accelX,accelY,accelZ);
+        // derived metrics are computed in batches for all samples received since the last main loop cycle
+        if (derivedNumEnabled) derivedBatchAdd(dr,temperature,humidity);
+        VPRINTFN(3," temperature: %5.3f, %d samples since the last influx write",temperature,dr->influxStats[stats_temp].count);
+        if (!dr->influxPendingSince) {
+            dr->influxPendingSince = time(NULL);
+            influxPending.points++;
+            influxPending.bytes += dr->influxLineLen ? dr->influxLineLen : INFLUX_LINE_ESTIMATE;
+            if (!influxPending.oldest) influxPending.oldest = dr->influxPendingSince;
+        }
         LOGN(1,"%012lx (%s): temp: %5.2f (%7.4f), humidity: %6.3f (%8.4f), pressure: %6d (%6d), batt: %5.2fV, txPower: %ddBm, rssi: %3d (%3d) mover: %d, seq: %d",macAddress,nm!=NULL?nm->name:NULL,temperature,deltaTemperature,humidity,deltaHumidity,pressure,deltaPressure,(double)batteryVoltage / 1000,txpower, rssi, deltaRssi, movementCounter, measurementSequence);
     } else {
-    	VPRINTFN(3," received same sequence, temperature: %5.3f dataInflux.temperature: %5.3f",temperature,dr->dataInflux.temperature);
+    	VPRINTFN(3," received same sequence, temperature: %5.3f",temperature);
     }
     dr->dataCurr.measurementSequence = measurementSequence;
     return true;
@@ -304,7 +420,7 @@ int processRuuviData(char * data, int rssi) {
 
 
 
-int msgarrvd(void *context, char *topicName, int topicLen, MQTTClient_message *message)
+int mqttReceiverMsgArrived(void *context, char *topicName, int topicLen, MQTTClient_message *message)
 {
 	char *tokenID;
 	cJSON *jmsg;
@@ -312,7 +428,7 @@ int msgarrvd(void *context, char *topicName, int topicLen, MQTTClient_message *m
 	cJSON *rssi = NULL;
 	int rssiValue = 0;
 
-	VPRINTFN(3,"S: msgarrvd, topicLen: %d",topicLen);
+	VPRINTFN(3,"S: mqttReceiverMsgArrived, topicLen: %d",topicLen);
 	tokenID = strrchr(topicName,'/');
 	if (tokenID) {
 		tokenID++;
@@ -360,7 +476,7 @@ int msgarrvd(void *context, char *topicName, int topicLen, MQTTClient_message *m
 	}
     MQTTClient_freeMessage(&message);
     MQTTClient_free(topicName);
-    VPRINTFN(3,"E: msgarrvd");
+    VPRINTFN(3,"E: mqttReceiverMsgArrived");
     return 1;
 }
 
@@ -372,8 +488,7 @@ void connlost(void *context, char *cause) {
     mqttReceiverConnectionLost++;
 }
 
-pthread_mutex_t mqttLock;
-int mqttMutexCreated;
+pthread_mutex_t mqttLock = PTHREAD_MUTEX_INITIALIZER;
 
 void mqttDataLock() {
 	pthread_mutex_lock(&mqttLock);
@@ -385,6 +500,14 @@ void mqttDataUnlock() {
 
 #define QOS         1
 
+int mqttReceiverV5;
+int mqttReceiveMaximum;
+int influxNumTiers;
+int derivedNumEnabled;
+derivedBatch_t derivedBatch;
+int accelRingSize;
+spikeFilter_t spikeFilter;
+
 int mqttReceiverInit (const char *hostname, int port, const char *topic, const char *clientID) {
 time_t t = time(NULL);
 struct tm tm = *localtime(&t);
@@ -392,14 +515,6 @@ char newClientID[512];
 
     sprintf(newClientID,"%s-%04d%02d%02d-%02d%02d%02d", clientID, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
 
-    if (mqttMutexCreated == 0) {
-		if (pthread_mutex_init(&mqttLock, NULL) != 0) {
-			EPRINTFN("mqttReceiverInit: mutex init failed\n");
-			exit (1);
-		}
-		mqttMutexCreated++;
-    }
-
     MQTTClient_connectOptions opts = MQTTClient_connectOptions_initializer;
     int rc;
     char *address;
@@ -407,13 +522,15 @@ char newClientID[512];
     address = (char *)calloc(1,strlen(hostname+20));
     sprintf(address,"%s:%d",hostname,port);
     EPRINTF("Connecting to MQTT server %s with client id '%s' and topic '%s'",address,newClientID,topic);
-    if ((rc = MQTTClient_create(&client, address, newClientID, MQTTCLIENT_PERSISTENCE_NONE, NULL)) != MQTTCLIENT_SUCCESS) {
+    MQTTClient_createOptions createOpts = MQTTClient_createOptions_initializer;
+    if (mqttReceiverV5) createOpts.MQTTVersion = MQTTVERSION_5;
+    if ((rc = MQTTClient_createWithOptions(&client, address, newClientID, MQTTCLIENT_PERSISTENCE_NONE, NULL, &createOpts)) != MQTTCLIENT_SUCCESS) {
         EPRINTFN("Failed to create client for address %s, return code %d", address, rc);
         free(address);
         return 0;
     }
 
-    if ((rc = MQTTClient_setCallbacks(client, NULL, connlost, msgarrvd, NULL)) != MQTTCLIENT_SUCCESS) {
+    if ((rc = MQTTClient_setCallbacks(client, NULL, connlost, mqttReceiverMsgArrived, NULL)) != MQTTCLIENT_SUCCESS) {
         EPRINTFN("Failed to set callbacks, return code %d", rc);
         free(address);
         return 0;
@@ -421,14 +538,48 @@ char newClientID[512];
 
     opts.keepAliveInterval = 20;
     opts.cleansession = 1;
-    if ((rc = MQTTClient_connect(client, &opts)) != MQTTCLIENT_SUCCESS)  {
+    if (mqttReceiverV5) {
+		MQTTProperties props = MQTTProperties_initializer;
+		MQTTProperty prop;
+		MQTTResponse response;
+
+		opts.MQTTVersion = MQTTVERSION_5;
+		opts.cleansession = 0;
+		opts.cleanstart = 1;
+		// max number of unacknowledged QOS 1 messages the broker sends to us
+		if (mqttReceiveMaximum > 0) {
+			memset(&prop,0,sizeof(prop));
+			prop.identifier = MQTTPROPERTY_CODE_RECEIVE_MAXIMUM;
+			prop.value.integer2 = mqttReceiveMaximum;
+			MQTTProperties_add(&props, &prop);
+		}
+		response = MQTTClient_connect5(client, &opts, &props, NULL);
+		rc = response.reasonCode;
+		MQTTResponse_free(response);
+		MQTTProperties_free(&props);
+		if (rc > 0) EPRINTFN("Connect to %s rejected: %s (%d)", address, MQTTReasonCode_toString((enum MQTTReasonCodes)rc), rc);
+    } else
+		rc = MQTTClient_connect(client, &opts);
+    if (rc != MQTTCLIENT_SUCCESS)  {
         EPRINTFN("Failed to connect to %s, return code %d", address, rc);
         free(address);
         return 0;
     }
-    LOGN(0,"connected to source MQTT server %s",address);
+    LOGN(0,"connected to source MQTT server %s%s",address,mqttReceiverV5 ? " (MQTT v5)" : "");
 	free(address);
-    if ((rc = MQTTClient_subscribe(client, topic, QOS)) != MQTTCLIENT_SUCCESS) {
+    if (mqttReceiverV5) {
+		// reason code is the granted QOS on success
+		MQTTResponse response = MQTTClient_subscribe5(client, topic, QOS, NULL, NULL);
+		rc = response.reasonCode;
+		MQTTResponse_free(response);
+		if (rc >= MQTTREASONCODE_UNSPECIFIED_ERROR) {
+			EPRINTFN("Failed to subscribe to topic \"%s\": %s (%d)", topic, MQTTReasonCode_toString((enum MQTTReasonCodes)rc), rc);
+			return 0;
+		}
+		if (rc >= 0) rc = MQTTCLIENT_SUCCESS;
+    } else
+		rc = MQTTClient_subscribe(client, topic, QOS);
+    if (rc != MQTTCLIENT_SUCCESS) {
         EPRINTFN("Failed to subscribe to topic \"%s\", return code %d\n", topic, rc);
         return 0;
     }
@@ -441,12 +592,21 @@ char newClientID[512];
 int mqttReceiverDone(const char *topic) {
 	int rc;
 
-	if ((rc = MQTTClient_unsubscribe(client, topic)) != MQTTCLIENT_SUCCESS) {
+	if (mqttReceiverV5) {
+		MQTTResponse response = MQTTClient_unsubscribe5(client, topic, NULL);
+		rc = response.reasonCode;
+		MQTTResponse_free(response);
+		if (rc > 0 && rc < MQTTREASONCODE_UNSPECIFIED_ERROR) rc = MQTTCLIENT_SUCCESS;
+	} else
+		rc = MQTTClient_unsubscribe(client, topic);
+	if (rc != MQTTCLIENT_SUCCESS) {
 		EPRINTFN("Failed to unsubscribe, return code %d", rc);
 	}
 
 
-    if ((rc = MQTTClient_disconnect(client, 10000)) != MQTTCLIENT_SUCCESS) {
+    if (mqttReceiverV5) rc = MQTTClient_disconnect5(client, 10000, MQTTREASONCODE_SUCCESS, NULL);
+    else rc = MQTTClient_disconnect(client, 10000);
+    if (rc != MQTTCLIENT_SUCCESS) {
         EPRINTFN("Failed to disconnect, return code %d", rc);
     }
 
@@ -2,6 +2,13 @@
 #define RUUVIMQTT_H_INCLUDED
 
 #include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include "timerwheel.h"
+#include "mqtt_publish.h"
+#include "derived.h"
+#include "accelring.h"
+#include "spikefilter.h"
 
 typedef struct nameMappings_t nameMappings_t;
 struct nameMappings_t {
@@ -22,25 +29,118 @@ typedef struct sensorData_t sensorData_t;
 struct sensorData_t {
 	double temperature,humidity;
 	int pressure,batteryVoltage,txpower,movementCounter,measurementSequence,rssi;
+	double derived[derived_numMetrics];     // computed in batches by the main loop if enabled by derived
 };
 
+// statistics of the samples received between influx writes, updated in O(1) per sample
+// the derived metrics follow in the order of derivedMetric_t
+typedef enum {stats_temp,stats_humidity,stats_pressure,stats_batt,stats_rssi,stats_dewpoint,stats_abshumidity,stats_vpd,stats_numFields} statsField_t;
+#define STATS_DERIVED(metric) ((statsField_t)(stats_dewpoint + (metric)))
+typedef enum {stat_last,stat_min,stat_max,stat_mean,stat_stddev,stat_count,stat_numStats} statKind_t;
+typedef struct {
+	int count;                  // 0 if no sample since the last influx write
+	double last,min,max,mean;
+	double m2;                  // sum of squared differences from the mean (Welford)
+} fieldStats_t;
+
+void fieldStats_add(fieldStats_t *s, double v);
+double fieldStats_get(const fieldStats_t *s, statKind_t kind);
+
+// per device state of a rollup tier (influxrollup), statistics over the current window
+typedef struct {
+	fieldStats_t stats[stats_numFields];    // reset at the end of each window
+	char *influxPrefix;         // escaped measurement,tag=name of the tier, created on first write
+} influxTierData_t;
+
+typedef enum {grafana_temp,grafana_U,grafana_humidity,grafana_dewpoint,grafana_abshumidity,grafana_vpd,grafana_numFields} grafanaField_t;
+#define GRAFANA_DERIVED(metric) ((grafanaField_t)(grafana_dewpoint + (metric)))
+
+// changes within the deadband of the last published value are not republished
+typedef enum {deadband_temp,deadband_humidity,deadband_pressure,deadband_batt,deadband_numFields} deadbandField_t;
+typedef struct {
+	int enabled;
+	double abs[deadband_numFields];     // in units of sensorData_t, 0=off
+	double rel[deadband_numFields];     // relative to the last published value, 0.01 = 1%
+} deadband_t;
+
+// samples with a spike in one of the enabled fields are dropped before they reach dataCurr
+typedef enum {spike_temp,spike_humidity,spike_pressure,spike_numFields} spikeField_t;
+typedef struct {
+	int windowSize;             // 0=off
+	double threshold;           // in scaled MADs
+	int enabled[spike_numFields];
+	double minDeviation[spike_numFields];   // in units of sensorData_t
+} spikeFilter_t;
+
 typedef struct dataRead_t dataRead_t;
 struct dataRead_t {
         int64_t mac;
 		char *tokenID;
 		char *name;
+		char macStr[13];            // upper case hex mac, used if no name is mapped
 		char *rawData;
+		char *influxPrefix;         // escaped measurement,tag=name, created on first write to influx
+		char *grafanaKey[grafana_numFields];    // escaped field keys (name.temp ...), created on first post to grafana
+		int grafanaKeyLen[grafana_numFields];
+		mqtt_topicT mqttTopic;      // mqttprefix + name, created on first publish
+		char *mqttTemplate;         // {"name":"measurement.name", "Temp":
+		int mqttTemplateLen;
+		char *mqttBulkKey;          // "name":{"Temp": for mqtt bulk messages
+		int mqttBulkKeyLen;
+		mqtt_topicT mqttCborTopic;  // mqttcborprefix + name, created on first publish
 
 		sensorData_t dataCurr;
 		sensorData_t dataLastSent;
-		sensorData_t dataInflux;
+		fieldStats_t influxStats[stats_numFields];  // reset after each influx write
+		influxTierData_t *tierData; // [influxNumTiers], NULL without rollup tiers
+		sensorData_t dataGrafana;   // values last posted to grafana
+		sensorData_t dataPublish;   // values released for mqtt and grafana, limited by the publish interval
         int updated;
+        int grafanaSent;            // 0 if not yet posted to grafana, all fields will be posted
+        time_t influxPendingSince;  // 0 if no data is pending to be written to influx
+        int influxLineLen;          // length of the last line written to influx, used for estimating pending bytes
+        int pubIntervalMs;          // min interval between mqtt/grafana publishes, -1 if not yet resolved
+        const deadband_t *deadband; // resolved with pubIntervalMs
+        uint64_t lastPublishMs;     // 0 if not yet published
+        timerWheelNode_t pubTimer;  // scheduled if updates are pending to be published
+        int pubDeferred;            // publish retried, all in-flight slots were in use
+        int pubPending;             // PUB_PENDING_* payloads not yet sent if pubDeferred is set
+        int pubResend;              // bulk publish failed, published again regardless of the deadband
+        accelRing_t accel;          // acceleration samples not yet written to influx, allocated if accelsamples > 0
+        char *influxAccelPrefix;    // escaped accelmeasurement,tag=name, created on first write to influx
+        spikeWindow_t spikeWindow[spike_numFields];
+        int spikeNumRejected;       // statistics
 
         dataRead_t *next;
 };
 
 extern dataRead_t *mqttDataRead;
 
+#define DEVICE_NAME(dr) ((dr)->name ? (dr)->name : (dr)->macStr)
+
+// used as estimate for pending bytes if a device has not yet been written to influx
+#define INFLUX_LINE_ESTIMATE 64
+
+typedef struct {
+	int points;                 // devices with data not yet written to influx
+	size_t bytes;               // estimated line protocol size of the pending points
+	time_t oldest;              // time the oldest pending point has been received, 0 if none
+} influxPending_t;
+
+// protected by mqttDataLock
+extern influxPending_t influxPending;
+
+// samples received since the last main loop cycle, the derived metrics are computed in one batch
+typedef struct {
+	int n,size;
+	dataRead_t **dr;
+	double *temp,*humidity;
+	double *values[derived_numMetrics];
+} derivedBatch_t;
+
+// protected by mqttDataLock
+extern derivedBatch_t derivedBatch;
+
 int64_t hex2int (const char *src, int nibbles, int isSigned);
 
 // 1=success
@@ -54,5 +154,14 @@ void mqttDataUnlock();
 int mqttReceiverInit (const char *hostname, int port, const char *topic, const char *clientID);
 int mqttReceiverDone (const char *topic);
 int mqttReceiver_isConnected();
+// processes a message from the ruuvi gateway, also used as subscription callback of the publisher with mqttsingleconnection
+int mqttReceiverMsgArrived(void *context, char *topicName, int topicLen, MQTTClient_message *message);
+
+extern int mqttReceiverV5;          // use MQTT v5 for the subscriber
+extern int mqttReceiveMaximum;      // v5 receive maximum, 0=broker default
+extern int influxNumTiers;          // number of rollup tiers, set before the receiver is started
+extern int derivedNumEnabled;       // number of derived metrics enabled, set before the receiver is started
+extern spikeFilter_t spikeFilter;   // set before the receiver is started
+extern int accelRingSize;           // acceleration samples per device, 0=off, set before the receiver is started
 
 #endif // RUUVIMQTT_H_INCLUDED
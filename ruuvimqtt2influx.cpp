@@ -21,6 +21,7 @@ and send the data to influxdb (1.x or 2.x API) and/or via mqtt
 #include <sys/ioctl.h>
 #include <signal.h>
 #include <time.h>
+#include <fnmatch.h>
 
 #include "log.h"
 
@@ -33,6 +34,8 @@ and send the data to influxdb (1.x or 2.x API) and/or via mqtt
 
 #include "ruuvimqtt.h"
 #include "MQTTClient.h"
+#include "cbor.h"
+#include "derived.h"
 #define VER "1.08 Armin Diehl <ad@ardiehl.de> Jan 9,2025, compiled " __DATE__ " " __TIME__
 
 #define ME "ruuvimqtt2influx"
@@ -44,9 +47,27 @@ and send the data to influxdb (1.x or 2.x API) and/or via mqtt
 
 char *configFileName;
 int dryrun;
-int queryIntervalSecs = 60 * 5; // 5 minutes
+int queryIntervalSecs = 60 * 5; // 5 minutes, max age of pending influx data
+int influxMaxPoints;            // flush policy, 0=disabled
+int influxMaxBytes;
+int influxMinIntervalSecs;
+int influxBackoffMaxSecs = INFLUX_BACKOFF_MAX_SECS;
+int influxDequeuePerSec = INFLUX_DEQUEUE_PER_SEC;
+int statsIntervalSecs;
+char *influxPrecision;
 char *formulaValMeterName;
-influx_client_t *iClient;
+influx_client_t *iFormatter;       // data is formatted once and queued to all influx targets
+influx_flushPolicy_t influxCollectPolicy;
+
+// influx targets, each target has its own queue, flush policy and sender thread
+typedef struct influxTarget_t {
+	char *spec;                 // name,key=value,... from influxtarget
+	influx_client_t *c;
+	int noRaw;                  // raw=0, only rollup tiers are written to this target
+	struct influxTarget_t *next;
+} influxTarget_t;
+
+influxTarget_t *influxTargets;
 
 mqtt_pubT *mClient;
 extern int mqttReceiverConnectionLost;
@@ -61,7 +82,20 @@ int influxWriteMult;    // write to influx only on x th query (>=2)
 int iVerifyPeer = 1;
 int mqttQOS;
 int mqttRetain;
+int mqttMaxInflight = MQTT_DEF_MAX_INFLIGHT;
+char * mqttBulk;
+int mqttBulkMaxSize = 65536;
+int mqttVersion = 3;
+int mqttMessageExpirySecs;
+int mqttTopicAliasMax = MQTT_DEF_TOPIC_ALIAS_MAX;
+int mqttSingleConnection;
+char * mqttPersistenceDir;
+int mqttPubWaitMs = 250;    // max wait for a free in-flight slot, 0 with mqttsingleconnection
+#define PUB_RETRY_MS 100    // retry delay for a device if all in-flight slots are in use
+#define QOS_SUBSCRIBE 1
+#define RECEIVER_RECONNECT_SECS 15
 char * mqttprefix;
+char * mqttCborPrefix;
 char * mqttTopic;
 #define MQTT_DEF_TOPIC "ruuvi"
 char * mqttReceiverClientID;
@@ -72,7 +106,104 @@ int gport = 3000;
 char *gtoken;
 char *gpushid;
 influx_client_t *gClient;
+influx_client_t *gFormatter;       // frames are formatted here, the buffer of gClient is used by its writer thread
 int gVerifyPeer = 1;
+int gRefreshSecs = 10;     // post all fields, only changed fields are posted in between
+int gPingSecs = WEBSOCKETS_PING_SECS;
+
+// min interval between mqtt/grafana publishes of a device, updates in between are coalesced
+#define PUB_WHEEL_SLOTS 1024
+#define PUB_WHEEL_TICK_MS 50
+typedef struct pubInterval_t {
+	char *pattern;              // device name or mac, wildcards as in shell patterns
+	int intervalMs;
+	struct pubInterval_t *next;
+} pubInterval_t;
+
+pubInterval_t *pubIntervals;
+int pubIntervalMs;          // default for devices not matching pubintervalfor, 0=off
+timerWheel_t pubWheel;
+unsigned long pubNumUpdates;      // statistics, updates received
+unsigned long pubNumPublished;    // updates published
+unsigned long pubNumCoalesced;    // updates replaced by a newer one before being published
+unsigned long pubNumSuppressed;   // updates within the deadband
+unsigned long pubNumForced;       // published within the deadband because of deadbandmaxsilence
+unsigned long pubNumBulkFailed;   // bulk messages not published, the devices are published again
+int pubNumDeferred;         // devices waiting for a free in-flight slot, new updates queue behind them
+
+// deadband, per device/group settings inherit fields not specified from the global one
+typedef struct deadbandFor_t {
+	char *pattern;
+	char *spec;
+	deadband_t deadband;
+	struct deadbandFor_t *next;
+} deadbandFor_t;
+
+char *deadbandSpec;
+deadband_t deadbandDefault;
+deadbandFor_t *deadbandFors;
+int deadbandMaxSilenceSecs = 300;
+const char * deadbandFieldNames[deadband_numFields] = {"temp","humidity","pressure","batt"};
+
+// spike filter, window=n,threshold=k,field=minimum deviation,...
+#define SPIKE_DEF_WINDOW 5
+#define SPIKE_DEF_THRESHOLD 3
+char *spikeFilterSpec;
+const char * spikeFieldNames[spike_numFields] = {"temp","humidity","pressure"};
+
+// fields written to influx, the statistics are collected between influx writes
+#define INFLUX_DEF_FIELDS "temp.last=Temp,batt.last=BattVoltage,humidity.max=Humidity"
+typedef struct influxField_t influxField_t;
+struct influxField_t {
+	statsField_t field;
+	statKind_t stat;
+	char *key;                  // escaped field key
+	int keyLen;
+	int precision;
+	influxField_t *next;
+};
+char * influxFieldsSpec;
+influxField_t *influxFields;
+const char * statsFieldNames[stats_numFields] = {"temp","humidity","pressure","batt","rssi","dewpoint","abshumidity","vpd"};
+const char * statsFieldKeys[stats_numFields] = {"Temp","Humidity","Pressure","BattVoltage","Rssi","DewPoint","AbsHumidity","VPD"};
+int statsFieldPrecision[stats_numFields] = {1,1,0,1,0,1,1,2};     // derived metrics can be changed by derived
+const char * statKindNames[stat_numStats] = {"last","min","max","mean","stddev","count"};
+
+// derived metrics, computed in batches for the samples received since the last main loop cycle
+char *derivedSpec;
+int derivedEnabled[derived_numMetrics];
+double derivedScale[derived_numMetrics];    // 10^precision, changes below are not posted to grafana
+
+// acceleration samples, written as separate measurement with the raw data
+#define ACCEL_DEF_MEASUREMENT "Acceleration"
+#define ACCEL_DEF_FIELDS "x,y,z"
+#define ACCEL_MAX_SAMPLES 65536
+typedef enum {accel_x,accel_y,accel_z,accel_magnitude,accel_tilt,accel_numFields} accelField_t;
+const char * accelFieldNames[accel_numFields] = {"x","y","z","magnitude","tilt"};
+const char * accelFieldKeys[accel_numFields] = {"X","Y","Z","Magnitude","Tilt"};
+char *accelMeasurement;
+char *accelFieldsSpec;
+int accelFields[accel_numFields];
+long accelNumWritten;       // statistics
+
+// rollup tiers, statistics over fixed windows written to their own measurement and targets
+#define INFLUX_ROLLUP_DEF_FIELDS "temp.mean=Temp+temp.min=TempMin+temp.max=TempMax+humidity.mean=Humidity+humidity.min=HumidityMin+humidity.max=HumidityMax+batt.last=BattVoltage"
+typedef struct influxTier_t influxTier_t;
+struct influxTier_t {
+	char *spec;                 // name,interval=secs,key=value,... from influxrollup
+	char *name;
+	int index;                  // into dataRead_t.tierData
+	int intervalSecs;
+	char *measurement;
+	influxField_t *fields;
+	influx_client_t **targets;  // NULL terminated
+	influx_client_t *formatter;
+	time_t windowEnd;           // windows are aligned to multiples of the interval
+	int numWrites;              // statistics
+	long numPoints;
+	influxTier_t *next;
+};
+influxTier_t *influxTiers;
 
 /* msleep(): Sleep for the requested number of milliseconds. */
 int msleep(long msec)
@@ -126,6 +257,514 @@ int mapCallback(argParse_handleT *a, char * arg) {
 }
 
 
+int pubIntervalCallback(argParse_handleT *a, char * arg) {
+	pubInterval_t *pi,*last;
+	char *p;
+
+	assert(arg != NULL);
+	p = strrchr(arg,',');
+	if (!p || p == arg || !*(p+1)) {
+		EPRINTFN("invalid argument for pubintervalfor (%s), expected pattern,milliseconds",arg);
+		exit(1);
+	}
+	pi = (pubInterval_t *)calloc(1,sizeof(pubInterval_t));
+	pi->pattern = strndup(arg,p-arg);
+	pi->intervalMs = atoi(p+1);
+	if (pubIntervals) {
+		last = pubIntervals;
+		while (last->next) last = last->next;
+		last->next = pi;
+	} else pubIntervals = pi;
+	return 0;
+}
+
+
+int deadbandForCallback(argParse_handleT *a, char * arg) {
+	deadbandFor_t *df,*last;
+	char *p;
+
+	assert(arg != NULL);
+	p = strchr(arg,',');
+	if (!p || p == arg) {
+		EPRINTFN("invalid argument for deadbandfor (%s), expected pattern,field=value,...",arg);
+		exit(1);
+	}
+	df = (deadbandFor_t *)calloc(1,sizeof(deadbandFor_t));
+	df->pattern = strndup(arg,p-arg);
+	df->spec = strdup(p+1);
+	if (deadbandFors) {
+		last = deadbandFors;
+		while (last->next) last = last->next;
+		last->next = df;
+	} else deadbandFors = df;
+	return 0;
+}
+
+
+// field=value,... values with a trailing % are relative to the last published value
+void deadbandParse(deadband_t *db, const char *spec, const char *optName) {
+	char *s,*key,*value,*end,*saveptr;
+	double v;
+	int i;
+
+	if (!spec) return;
+	s = strdup(spec);
+	for (key = strtok_r(s,",",&saveptr); key; key = strtok_r(NULL,",",&saveptr)) {
+		value = strchr(key,'=');
+		if (!value) {
+			EPRINTFN("%s: expected field=value, got \"%s\"",optName,key);
+			exit(1);
+		}
+		*value++ = '\0';
+		for (i=0;i<deadband_numFields;i++) if (strcmp(key,deadbandFieldNames[i]) == 0) break;
+		if (i >= deadband_numFields) {
+			EPRINTFN("%s: unknown field \"%s\", expected temp, humidity, pressure or batt",optName,key);
+			exit(1);
+		}
+		v = strtod(value,&end);
+		if (end == value || v < 0 || (*end && strcmp(end,"%") != 0)) {
+			EPRINTFN("%s: invalid value \"%s\" for %s",optName,value,key);
+			exit(1);
+		}
+		if (*end) db->rel[i] = v / 100; else db->abs[i] = v;
+	}
+	db->enabled = 0;
+	for (i=0;i<deadband_numFields;i++) if (db->abs[i] > 0 || db->rel[i] > 0) db->enabled = 1;
+	free(s);
+}
+
+
+// field.stat[=name][:precision] separated by sep, e.g. temp.max=TempMax:2, the name defaults to Temp_max
+influxField_t * influxFieldsParse(const char *spec, const char *sep, const char *optName) {
+	char *s,*item,*stat,*name,*prec,*end,*saveptr;
+	char defName[64];
+	influxField_t *f,*fields = NULL,*last = NULL;
+	int i,k;
+
+	s = strdup(spec);
+	for (item = strtok_r(s,sep,&saveptr); item; item = strtok_r(NULL,sep,&saveptr)) {
+		prec = strchr(item,':');
+		if (prec) *prec++ = '\0';
+		name = strchr(item,'=');
+		if (name) *name++ = '\0';
+		stat = strchr(item,'.');
+		if (!stat) {
+			EPRINTFN("%s: expected field.stat, got \"%s\"",optName,item);
+			exit(1);
+		}
+		*stat++ = '\0';
+		for (i=0;i<stats_numFields;i++) if (strcmp(item,statsFieldNames[i]) == 0) break;
+		if (i >= stats_numFields) {
+			EPRINTFN("%s: unknown field \"%s\", expected temp, humidity, pressure, batt, rssi, dewpoint, abshumidity or vpd",optName,item);
+			exit(1);
+		}
+		if (i >= stats_dewpoint && !derivedEnabled[i - stats_dewpoint]) {
+			EPRINTFN("%s: %s has to be enabled by derived",optName,item);
+			exit(1);
+		}
+		for (k=0;k<stat_numStats;k++) if (strcmp(stat,statKindNames[k]) == 0) break;
+		if (k >= stat_numStats) {
+			EPRINTFN("%s: unknown statistic \"%s\", expected last, min, max, mean, stddev or count",optName,stat);
+			exit(1);
+		}
+		f = (influxField_t *)calloc(1,sizeof(influxField_t));
+		if (!f) { EPRINTFN("out of memory"); exit(1); }
+		f->field = (statsField_t)i;
+		f->stat = (statKind_t)k;
+		f->precision = k == stat_count ? 0 : statsFieldPrecision[i];
+		if (prec) {
+			f->precision = strtol(prec,&end,10);
+			if (end == prec || *end || f->precision < 0 || f->precision > 15) {
+				EPRINTFN("%s: invalid precision \"%s\" for %s.%s",optName,prec,item,stat);
+				exit(1);
+			}
+		}
+		if (!name || !*name) {
+			snprintf(defName,sizeof(defName),"%s_%s",statsFieldKeys[i],stat);
+			name = defName;
+		}
+		f->key = influxdb_format_key(name,&f->keyLen);
+		if (!f->key) { EPRINTFN("out of memory"); exit(1); }
+		if (last) last->next = f; else fields = f;
+		last = f;
+	}
+	free(s);
+	if (!fields) {
+		EPRINTFN("%s: at least one field is required",optName);
+		exit(1);
+	}
+	return fields;
+}
+
+
+// enabled derived metrics not selected by fields are appended as metric.stat with the default key
+void influxFieldsAddDerived(influxField_t *fields, statKind_t stat) {
+	influxField_t *f,*last = NULL;
+	int m;
+
+	for (m=0;m<derived_numMetrics;m++) {
+		if (!derivedEnabled[m]) continue;
+		for (f = fields; f; f = f->next) {
+			if (f->field == STATS_DERIVED(m)) break;
+			last = f;
+		}
+		if (f) continue;
+		f = (influxField_t *)calloc(1,sizeof(influxField_t));
+		if (!f) { EPRINTFN("out of memory"); exit(1); }
+		f->field = STATS_DERIVED(m);
+		f->stat = stat;
+		f->precision = statsFieldPrecision[f->field];
+		f->key = influxdb_format_key(statsFieldKeys[f->field],&f->keyLen);
+		if (!f->key) { EPRINTFN("out of memory"); exit(1); }
+		last->next = f;
+	}
+}
+
+
+// window=n,threshold=k,field=minimum deviation,... only the fields specified are checked
+void spikeFilterParse(const char *spec) {
+	char *s,*key,*value,*end,*saveptr;
+	double v;
+	int i,numFields = 0;
+
+	if (!spec) return;
+	spikeFilter.windowSize = SPIKE_DEF_WINDOW;
+	spikeFilter.threshold = SPIKE_DEF_THRESHOLD;
+	s = strdup(spec);
+	for (key = strtok_r(s,",",&saveptr); key; key = strtok_r(NULL,",",&saveptr)) {
+		value = strchr(key,'=');
+		if (!value) {
+			EPRINTFN("spikefilter: expected key=value, got \"%s\"",key);
+			exit(1);
+		}
+		*value++ = '\0';
+		v = strtod(value,&end);
+		if (end == value || *end || v < 0) {
+			EPRINTFN("spikefilter: invalid value \"%s\" for %s",value,key);
+			exit(1);
+		}
+		if (strcmp(key,"window") == 0) {
+			spikeFilter.windowSize = (int)v;
+			if (spikeFilter.windowSize < 3 || spikeFilter.windowSize > SPIKEFILTER_MAX_WINDOW) {
+				EPRINTFN("spikefilter: window has to be 3 to %d",SPIKEFILTER_MAX_WINDOW);
+				exit(1);
+			}
+			continue;
+		}
+		if (strcmp(key,"threshold") == 0) {
+			spikeFilter.threshold = v;
+			continue;
+		}
+		for (i=0;i<spike_numFields;i++) if (strcmp(key,spikeFieldNames[i]) == 0) break;
+		if (i >= spike_numFields) {
+			EPRINTFN("spikefilter: unknown key \"%s\", expected window, threshold, temp, humidity or pressure",key);
+			exit(1);
+		}
+		if (v <= 0) {
+			EPRINTFN("spikefilter: the minimum deviation for %s has to be greater than 0",key);
+			exit(1);
+		}
+		spikeFilter.enabled[i] = 1;
+		spikeFilter.minDeviation[i] = v;
+		numFields++;
+	}
+	free(s);
+	if (!numFields) {
+		EPRINTFN("spikefilter: at least one of temp, humidity or pressure is required");
+		exit(1);
+	}
+}
+
+
+// x,y,z,magnitude,tilt
+void accelFieldsParse(const char *spec) {
+	char *s,*item,*saveptr;
+	int i,n = 0;
+
+	s = strdup(spec);
+	for (item = strtok_r(s,",",&saveptr); item; item = strtok_r(NULL,",",&saveptr)) {
+		for (i=0;i<accel_numFields;i++) if (strcmp(item,accelFieldNames[i]) == 0) break;
+		if (i >= accel_numFields) {
+			EPRINTFN("accelfields: unknown field \"%s\", expected x, y, z, magnitude or tilt",item);
+			exit(1);
+		}
+		accelFields[i] = 1;
+		n++;
+	}
+	free(s);
+	if (!n) {
+		EPRINTFN("accelfields: at least one field is required");
+		exit(1);
+	}
+}
+
+
+// metric[:precision],... e.g. dewpoint,vpd:3
+void derivedParse(const char *spec) {
+	char *s,*item,*prec,*end,*saveptr;
+	int m;
+
+	for (m=0;m<derived_numMetrics;m++) derivedScale[m] = pow(10,statsFieldPrecision[STATS_DERIVED(m)]);
+	if (!spec) return;
+	s = strdup(spec);
+	for (item = strtok_r(s,",",&saveptr); item; item = strtok_r(NULL,",",&saveptr)) {
+		prec = strchr(item,':');
+		if (prec) *prec++ = '\0';
+		for (m=0;m<derived_numMetrics;m++) if (strcmp(item,statsFieldNames[STATS_DERIVED(m)]) == 0) break;
+		if (m >= derived_numMetrics) {
+			EPRINTFN("derived: unknown metric \"%s\", expected dewpoint, abshumidity or vpd",item);
+			exit(1);
+		}
+		if (prec) {
+			int precision = strtol(prec,&end,10);
+			if (end == prec || *end || precision < 0 || precision > 15) {
+				EPRINTFN("derived: invalid precision \"%s\" for %s",prec,item);
+				exit(1);
+			}
+			statsFieldPrecision[STATS_DERIVED(m)] = precision;
+			derivedScale[m] = pow(10,precision);
+		}
+		if (!derivedEnabled[m]) derivedNumEnabled++;
+		derivedEnabled[m] = 1;
+	}
+	free(s);
+}
+
+
+void influxFieldsFree(influxField_t *fields) {
+	while (fields) {
+		influxField_t *f = fields;
+		fields = f->next;
+		free(f->key);
+		free(f);
+	}
+}
+
+
+
+// 1 if at least one field changed by more than the deadband
+int deadbandExceeded(const deadband_t *db, const sensorData_t *curr, const sensorData_t *last) {
+	double v[deadband_numFields] = {curr->temperature,curr->humidity,(double)curr->pressure,(double)curr->batteryVoltage};
+	double l[deadband_numFields] = {last->temperature,last->humidity,(double)last->pressure,(double)last->batteryVoltage};
+	double band,delta;
+
+	for (int i=0;i<deadband_numFields;i++) {
+		delta = fabs(v[i] - l[i]);
+		band = db->rel[i] * fabs(l[i]);
+		if (db->abs[i] > band) band = db->abs[i];
+		if (band > 0 ? delta + 1e-9 >= band : delta != 0) return 1;
+	}
+	return 0;
+}
+
+
+// first matching pubintervalfor/deadbandfor wins
+void pubIntervalResolve(dataRead_t *dr) {
+	dr->pubIntervalMs = pubIntervalMs;
+	for (pubInterval_t *pi = pubIntervals; pi; pi = pi->next) {
+		if (fnmatch(pi->pattern,DEVICE_NAME(dr),0) == 0 || fnmatch(pi->pattern,dr->macStr,FNM_CASEFOLD) == 0) {
+			dr->pubIntervalMs = pi->intervalMs;
+			break;
+		}
+	}
+	if (dr->pubIntervalMs < 0) dr->pubIntervalMs = 0;
+	dr->pubTimer.data = dr;
+	dr->deadband = &deadbandDefault;
+	for (deadbandFor_t *df = deadbandFors; df; df = df->next) {
+		if (fnmatch(df->pattern,DEVICE_NAME(dr),0) == 0 || fnmatch(df->pattern,dr->macStr,FNM_CASEFOLD) == 0) {
+			dr->deadband = &df->deadband;
+			break;
+		}
+	}
+	if (dr->pubIntervalMs) VPRINTFN(2,"%s: publish interval %d ms",DEVICE_NAME(dr),dr->pubIntervalMs);
+}
+
+
+void influxTargetAdd(influxTarget_t *t);
+
+int influxTargetCallback(argParse_handleT *a, char * arg) {
+	influxTarget_t *t;
+
+	assert(arg != NULL);
+	t = (influxTarget_t *)calloc(1,sizeof(influxTarget_t));
+	t->spec = strdup(arg);
+	influxTargetAdd(t);
+	return 0;
+}
+
+
+void influxTargetAdd(influxTarget_t *t) {
+	influxTarget_t *last;
+
+	if (influxTargets) {
+		last = influxTargets;
+		while (last->next) last = last->next;
+		last->next = t;
+	} else influxTargets = t;
+}
+
+
+// the api string is used as is, a precision other than ns has to be part of it
+int influxApiCheckPrecision(const char *name, const char *api) {
+	if (!api || !influxPrecision || strcmp(influxPrecision,"ns") == 0 || strstr(api,"precision=")) return 0;
+	EPRINTFN("%s: influxprecision %s requires precision= in the api string \"%s\"",name,influxPrecision,api);
+	return -1;
+}
+
+
+// creates the client for a target specified as name,key=value,...
+// values not specified default to the corresponding global options
+int influxTargetInit(influxTarget_t *t, int defPort, int defNumQueueEntries) {
+	char *spec,*name,*key,*value,*saveptr;
+	char *server = NULL,*db = NULL,*user = NULL,*password = NULL,*org = NULL,*bucket = NULL,*token = NULL,*api = NULL;
+	int port = defPort;
+	int numQueueEntries = defNumQueueEntries;
+	int verifyPeer = iVerifyPeer;
+	int maxPoints = 0, maxBytes = 0, maxAge = 0, minInterval = 0;
+	int backoffMax = influxBackoffMaxSecs;
+	int dequeueRate = influxDequeuePerSec;
+	int mtu = 0;
+
+	spec = strdup(t->spec);
+	name = strtok_r(spec,",",&saveptr);
+	if (!name || !*name || strchr(name,'=')) {
+		EPRINTFN("influxtarget \"%s\": expected name,key=value,...",t->spec);
+		exit(1);
+	}
+	while ((key = strtok_r(NULL,",",&saveptr))) {
+		value = strchr(key,'=');
+		if (!value) {
+			EPRINTFN("influxtarget %s: expected key=value, got \"%s\"",name,key);
+			exit(1);
+		}
+		*value++ = '\0';
+		if (strcmp(key,"server") == 0) server = value;
+		else if (strcmp(key,"port") == 0) port = atoi(value);
+		else if (strcmp(key,"db") == 0) db = value;
+		else if (strcmp(key,"user") == 0) user = value;
+		else if (strcmp(key,"password") == 0) password = value;
+		else if (strcmp(key,"org") == 0) org = value;
+		else if (strcmp(key,"bucket") == 0) bucket = value;
+		else if (strcmp(key,"token") == 0) token = value;
+		else if (strcmp(key,"api") == 0) api = value;
+		else if (strcmp(key,"cache") == 0) numQueueEntries = atoi(value);
+		else if (strcmp(key,"sslverifypeer") == 0) verifyPeer = atoi(value);
+		else if (strcmp(key,"maxpoints") == 0) maxPoints = atoi(value);
+		else if (strcmp(key,"maxbytes") == 0) maxBytes = atoi(value);
+		else if (strcmp(key,"maxage") == 0) maxAge = atoi(value);
+		else if (strcmp(key,"mininterval") == 0) minInterval = atoi(value);
+		else if (strcmp(key,"backoffmax") == 0) backoffMax = atoi(value);
+		else if (strcmp(key,"dequeuerate") == 0) dequeueRate = atoi(value);
+		else if (strcmp(key,"mtu") == 0) mtu = atoi(value);
+		else if (strcmp(key,"raw") == 0) t->noRaw = !atoi(value);
+		else {
+			EPRINTFN("influxtarget %s: unknown key \"%s\"",name,key);
+			exit(1);
+		}
+	}
+	if (!server) {
+		EPRINTFN("influxtarget %s: no server specified",name);
+		exit(1);
+	}
+	if (influxApiCheckPrecision(name,api) != 0) exit(1);
+	LOG(1,"Influx target %s: server: %s, port %d, db: %s, user: %s, org: %s, bucket: %s, numQueueEntries %d\n",name,server,port,db,user,org,bucket,numQueueEntries);
+	t->c = influxdb_post_init (server, port, db, user, password, org, bucket, token, numQueueEntries, api, verifyPeer);
+	if (!t->c) {
+		free(spec);
+		return -1;
+	}
+	free(t->c->name);
+	t->c->name = strdup(name);
+	influxdb_post_setFlushPolicy(t->c, maxPoints, maxBytes, maxAge, minInterval);
+	influxdb_post_setBackoff(t->c, backoffMax, dequeueRate);
+	influxdb_post_setPrecision(t->c, influxPrecision);
+	influxdb_post_setUdpMtu(t->c, mtu);
+	free(spec);
+	return 0;
+}
+
+
+int influxRollupCallback(argParse_handleT *a, char * arg) {
+	influxTier_t *tier,*last;
+
+	assert(arg != NULL);
+	tier = (influxTier_t *)calloc(1,sizeof(influxTier_t));
+	tier->spec = strdup(arg);
+	tier->index = influxNumTiers++;
+	if (influxTiers) {
+		last = influxTiers;
+		while (last->next) last = last->next;
+		last->next = tier;
+	} else influxTiers = tier;
+	return 0;
+}
+
+
+// parses name,interval=secs,key=value,... of a rollup tier, called after the influx targets have been created
+void influxTierInit(influxTier_t *tier, time_t now) {
+	char *spec,*name,*key,*value,*saveptr,*tname,*tsaveptr;
+	char *targets = NULL,*fields = NULL;
+	influxTarget_t *t;
+	int numTargets = 0;
+
+	spec = strdup(tier->spec);
+	name = strtok_r(spec,",",&saveptr);
+	if (!name || !*name || strchr(name,'=')) {
+		EPRINTFN("influxrollup \"%s\": expected name,interval=secs,key=value,...",tier->spec);
+		exit(1);
+	}
+	tier->name = strdup(name);
+	while ((key = strtok_r(NULL,",",&saveptr))) {
+		value = strchr(key,'=');
+		if (!value) {
+			EPRINTFN("influxrollup %s: expected key=value, got \"%s\"",name,key);
+			exit(1);
+		}
+		*value++ = '\0';
+		if (strcmp(key,"interval") == 0) tier->intervalSecs = atoi(value);
+		else if (strcmp(key,"measurement") == 0) { free(tier->measurement); tier->measurement = strdup(value); }
+		else if (strcmp(key,"targets") == 0) targets = value;
+		else if (strcmp(key,"fields") == 0) fields = value;
+		else {
+			EPRINTFN("influxrollup %s: unknown key \"%s\"",name,key);
+			exit(1);
+		}
+	}
+	if (tier->intervalSecs <= 0) {
+		EPRINTFN("influxrollup %s: interval in seconds > 0 required",name);
+		exit(1);
+	}
+	if (!tier->measurement) {
+		tier->measurement = (char *)malloc(strlen(influxMeasurement)+1+strlen(name)+1);
+		sprintf(tier->measurement,"%s_%s",influxMeasurement,name);
+	}
+	tier->fields = influxFieldsParse(fields ? fields : INFLUX_ROLLUP_DEF_FIELDS, "+", "influxrollup");
+	influxFieldsAddDerived(tier->fields, stat_mean);
+
+	// targets separated by +, default all
+	for (t = influxTargets; t; t = t->next) numTargets++;
+	tier->targets = (influx_client_t **)calloc(numTargets+1,sizeof(influx_client_t *));
+	numTargets = 0;
+	if (targets) {
+		for (tname = strtok_r(targets,"+",&tsaveptr); tname; tname = strtok_r(NULL,"+",&tsaveptr)) {
+			for (t = influxTargets; t; t = t->next) if (strcmp(t->c->name,tname) == 0) break;
+			if (!t) {
+				EPRINTFN("influxrollup %s: unknown influx target \"%s\"",name,tname);
+				exit(1);
+			}
+			tier->targets[numTargets++] = t->c;
+		}
+	} else
+		for (t = influxTargets; t; t = t->next) tier->targets[numTargets++] = t->c;
+
+	tier->formatter = influxdb_post_init (NULL, 0, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, 0);
+	influxdb_post_setPrecision(tier->formatter, influxPrecision);
+	tier->windowEnd = (now / tier->intervalSecs + 1) * tier->intervalSecs;
+	LOG(1,"Influx rollup %s: interval %d seconds, measurement: %s, %d targets\n",tier->name,tier->intervalSecs,tier->measurement,numTargets);
+	free(spec);
+}
+
+
 int showVersionCallback(argParse_handleT *a, char * arg) {
 	MQTTClient_nameValue* MQTTVersionInfo;
 	char *MQTTVersion = NULL;
@@ -171,6 +810,8 @@ int dummyCallback(argParse_handleT *a, char * arg) {
 	return 0;
 }
 
+int benchmarkCallback(argParse_handleT *a, char * arg);
+
 #define CONFFILEARG "--configfile="
 
 int parseArgs (int argc, char **argv) {
@@ -190,7 +831,10 @@ int parseArgs (int argc, char **argv) {
 	char * influxApiStr = NULL;
 
 	influxMeasurement = strdup(INFLUX_DEFAULT_MEASUREMENT);
+	influxFieldsSpec = strdup(INFLUX_DEF_FIELDS);
 	influxTagName = strdup(INFLUX_DEFAULT_TAGNAME);
+	accelMeasurement = strdup(ACCEL_DEF_MEASUREMENT);
+	accelFieldsSpec = strdup(ACCEL_DEF_FIELDS);
 
 	AP_START(argopt)
 		AP_HELP
@@ -210,11 +854,34 @@ int parseArgs (int argc, char **argv) {
 		AP_OPT_INTVAL       (1,0  ,"isslverifypeer" ,&iVerifyPeer          ,"Influx SSL certificate verification (0=off)")
 		AP_OPT_STRVAL       (0,'A',"influxapi"      ,&influxApiStr         ,"Influxdb api string, if specified db..token will not be used")
 		AP_OPT_INTVAL       (1,'c',"cache"          ,&numQueueEntries      ,"#entries for influxdb cache")
+		AP_OPT_INTVAL       (1,0  ,"influxmaxpoints",&influxMaxPoints      ,"write to influx if # devices with new data reached (0=off)")
+		AP_OPT_INTVAL       (1,0  ,"influxmaxbytes" ,&influxMaxBytes       ,"write to influx if pending data reached size in bytes (0=off)")
+		AP_OPT_INTVAL       (1,0  ,"influxmininterval",&influxMinIntervalSecs,"minimum interval in seconds between influx writes")
+		AP_OPT_STRVAL       (1,0  ,"influxfields"   ,&influxFieldsSpec     ,"field.stat[=name][:precision],... - fields written to influx, stats: last, min, max, mean, stddev, count")
+		AP_OPT_STRVAL       (1,0  ,"derived"        ,&derivedSpec          ,"metric[:precision],... - metrics derived from temp and humidity written to all sinks: dewpoint, abshumidity, vpd")
+		AP_OPT_INTVAL       (1,0  ,"accelsamples"   ,&accelRingSize        ,"acceleration samples kept per device until written to influx (0=off)")
+		AP_OPT_STRVAL       (1,0  ,"accelmeasurement",&accelMeasurement    ,"influx measurement for acceleration samples")
+		AP_OPT_STRVAL       (1,0  ,"accelfields"    ,&accelFieldsSpec      ,"acceleration fields written to influx: x, y, z, magnitude, tilt")
+		AP_OPT_STRVAL       (1,0  ,"influxprecision",&influxPrecision      ,"timestamp precision for influx writes, s, ms, us or ns")
+		AP_OPT_INTVAL       (1,0  ,"influxbackoffmax",&influxBackoffMaxSecs ,"max seconds between connection attempts after failures")
+		AP_OPT_INTVAL       (1,0  ,"influxdequeuerate",&influxDequeuePerSec ,"max cached entries per second to post after a failure")
+		AP_OPT_STRVAL_CB    (0,0  ,"influxtarget"   ,NULL                  ,"name,key=value,... - additional influx target, can be specified multiple times",&influxTargetCallback)
+		AP_OPT_STRVAL_CB    (0,0  ,"influxrollup"   ,NULL                  ,"name,interval=secs,key=value,... - write statistics over fixed windows, can be specified multiple times",&influxRollupCallback)
 		AP_OPT_STRVAL       (1,'M',"mqttserver"     ,&mClient->hostname    ,"mqtt server name or ip")
 		AP_OPT_STRVAL       (1,'C',"mqttprefix"     ,&mqttprefix           ,"prefix for mqtt publish")
 		AP_OPT_INTVAL       (1,'R',"mqttport"       ,&mClient->port        ,"ip port for mqtt server")
 		AP_OPT_INTVAL       (1,'Q',"mqttqos"        ,&mqttQOS              ,"default mqtt QOS, can be changed for meter")
 		AP_OPT_INTVAL       (1,'r',"mqttretain"     ,&mqttRetain           ,"default mqtt retain, can be changed for meter")
+		AP_OPT_INTVAL       (1,0  ,"mqttmaxinflight",&mqttMaxInflight      ,"max number of unacknowledged mqtt messages for QOS 1 and 2")
+		AP_OPT_STRVAL       (1,0  ,"mqttcborprefix" ,&mqttCborPrefix       ,"prefix for mqtt publish with CBOR payload")
+		AP_OPT_STRVAL       (1,0  ,"mqttbulk"       ,&mqttBulk             ,"topic (appended to mqttprefix) for publishing all changed devices in one message")
+		AP_OPT_INTVAL       (1,0  ,"mqttbulkmaxsize",&mqttBulkMaxSize      ,"max size in bytes of a bulk message, larger ones are split")
+		AP_OPT_INTVAL       (1,0  ,"mqttversion"    ,&mqttVersion          ,"mqtt protocol version, 3 or 5")
+		AP_OPT_INTVAL       (1,0  ,"mqttmessageexpiry",&mqttMessageExpirySecs,"v5: message expiry interval in seconds for published messages (0=off)")
+		AP_OPT_INTVAL       (1,0  ,"mqtttopicaliasmax",&mqttTopicAliasMax  ,"v5: max number of topic aliases for published messages (0=off)")
+		AP_OPT_INTVAL       (1,0  ,"mqttreceivemax" ,&mqttReceiveMaximum   ,"v5: max number of unacknowledged messages from the broker (0=broker default)")
+		AP_OPT_STRVAL       (1,0  ,"mqttpersistencedir",&mqttPersistenceDir,"directory for storing mqtt messages in flight (QOS 1 and 2) across restarts")
+		AP_OPT_INTVAL       (1,0  ,"mqttsingleconnection",&mqttSingleConnection,"1=use one mqtt connection for subscribe and publish")
 		AP_OPT_STRVAL       (1,'t',"mqtttopic"      ,&mqttTopic            ,"topic for mqtt subscribe")
 
 		AP_OPT_STRVAL       (1,'i',"mqttclientid"   ,&mClient->clientId    ,"mqtt client id")
@@ -224,12 +891,22 @@ int parseArgs (int argc, char **argv) {
 		AP_OPT_STRVAL       (1,0  ,"gtoken"         ,&gtoken               ,"authorisation api token for Grafana")
 		AP_OPT_STRVAL       (1,0  ,"gpushid"        ,&gpushid              ,"push id for Grafana")
 		AP_OPT_INTVAL       (1,0  ,"gsslverifypeer" ,&gVerifyPeer          ,"grafana SSL certificate verification (0=off)")
+		AP_OPT_INTVAL       (1,0  ,"grefresh"       ,&gRefreshSecs         ,"interval in seconds for posting all values to Grafana")
+		AP_OPT_INTVAL       (1,0  ,"gpinginterval"  ,&gPingSecs            ,"websocket keepalive interval in seconds for Grafana (0=off)")
+		AP_OPT_INTVAL       (1,0  ,"pubinterval"    ,&pubIntervalMs        ,"min interval in ms between mqtt/grafana publishes of a device (0=off)")
+		AP_OPT_STRVAL_CB    (0,0  ,"pubintervalfor" ,NULL                  ,"pattern,ms - publish interval for matching devices, can be specified multiple times",&pubIntervalCallback)
+		AP_OPT_STRVAL       (1,0  ,"deadband"       ,&deadbandSpec         ,"field=value[%],... - changes not republished, fields: temp, humidity, pressure, batt")
+		AP_OPT_STRVAL_CB    (0,0  ,"deadbandfor"    ,NULL                  ,"pattern,field=value[%],... - deadband for matching devices, can be specified multiple times",&deadbandForCallback)
+		AP_OPT_INTVAL       (1,0  ,"deadbandmaxsilence",&deadbandMaxSilenceSecs,"republish changes within the deadband after x seconds (0=never)")
+		AP_OPT_STRVAL       (1,0  ,"spikefilter"    ,&spikeFilterSpec      ,"window=n,threshold=k,field=mindev,... - drop samples deviating from the median of the last n, fields: temp, humidity, pressure")
 
 		AP_OPT_STRVAL_CB    (0,'a',"map"            ,NULL                  ,"id,name - map id to name, can be specified multiple times",&mapCallback)
 		AP_OPT_INTVALFO     (0,'v',"verbose"        ,&log_verbosity        ,"increase or set verbose level")
-		AP_OPT_INTVAL       (1,'P',"poll"           ,&queryIntervalSecs    ,"poll intervall in seconds")
+		AP_OPT_INTVAL       (1,'P',"poll"           ,&queryIntervalSecs    ,"max age in seconds of data pending to be written to influx")
+		AP_OPT_INTVAL       (1,0  ,"statsinterval"  ,&statsIntervalSecs    ,"log statistics every x seconds (0=off)")
 		AP_OPT_INTVALF      (0,'y',"syslog"         ,&syslog               ,"log to syslog insead of stderr")
 		AP_OPT_INTVALF_CB   (0,'Y',"syslogtest"     ,NULL                  ,"send a testtext to syslog and exit",&syslogTestCallback)
+		AP_OPT_INTVALF_CB   (0,0  ,"benchmark"      ,NULL                  ,"benchmark the mqtt payload encoders and exit",&benchmarkCallback)
 		AP_OPT_INTVALF_CB   (0,'V',"version"        ,NULL                  ,"show version and exit",&showVersionCallback)
 		AP_OPT_INTVALFO     (0,'U',"dryrun"         ,&dryrun               ,"Show what would be written to MQTT/Influx/Grafana")
 	AP_END;
@@ -263,18 +940,67 @@ int parseArgs (int argc, char **argv) {
 	}
 
 
+	derivedParse(derivedSpec);
+	spikeFilterParse(spikeFilterSpec);
+	accelFieldsParse(accelFieldsSpec);
+	if (accelRingSize < 0 || accelRingSize > ACCEL_MAX_SAMPLES) {
+		EPRINTFN("invalid accelsamples %d, expected 0 to %d",accelRingSize,ACCEL_MAX_SAMPLES);
+		exit(1);
+	}
+	influxFields = influxFieldsParse(influxFieldsSpec, ",", "influxfields");
+	influxFieldsAddDerived(influxFields, stat_last);
+	deadbandParse(&deadbandDefault, deadbandSpec, "deadband");
+	for (deadbandFor_t *df = deadbandFors; df; df = df->next) {
+		df->deadband = deadbandDefault;
+		deadbandParse(&df->deadband, df->spec, "deadbandfor");
+	}
+
+	if (mqttVersion != 3 && mqttVersion != 5) {
+		EPRINTFN("invalid mqttversion %d, expected 3 or 5",mqttVersion);
+		exit(1);
+	}
+	mqttReceiverV5 = (mqttVersion == 5);
+
+	if (influxdb_post_setPrecision(NULL, influxPrecision) != 0) {
+		EPRINTFN("invalid influxprecision '%s', expected s, ms, us or ns",influxPrecision);
+		exit(1);
+	}
+	if (serverName && influxApiCheckPrecision("influxapi",influxApiStr) != 0) exit(1);
+
 	if (serverName) {
 		LOG(1,"Influx init: serverName: %s, port %d, dbName: %s, userName: %s, password: %s, org: %s, bucket:%s, numQueueEntries %d\n",serverName, port, dbName, userName, password, org, bucket, numQueueEntries);
-		iClient = influxdb_post_init (serverName, port, dbName, userName, password, org, bucket, token, numQueueEntries, influxApiStr, iVerifyPeer);
-	} else {
-		free(dbName);
-		free(serverName);
-		free(userName);
-		free(password);
-		free(bucket);
-		free(org);
-		free(token);
-		free(influxApiStr);
+		influxTarget_t *t = (influxTarget_t *)calloc(1,sizeof(influxTarget_t));
+		t->c = influxdb_post_init (serverName, port, dbName, userName, password, org, bucket, token, numQueueEntries, influxApiStr, iVerifyPeer);
+		free(t->c->name);
+		t->c->name = strdup("influx");
+		influxdb_post_setBackoff(t->c, influxBackoffMaxSecs, influxDequeuePerSec);
+		influxdb_post_setPrecision(t->c, influxPrecision);
+		t->next = influxTargets;		// the default target is the first one
+		influxTargets = t;
+	}
+	free(dbName);
+	free(serverName);
+	free(userName);
+	free(password);
+	free(bucket);
+	free(org);
+	free(token);
+	free(influxApiStr);
+
+	for (influxTarget_t *t = influxTargets; t; t = t->next)
+		if (!t->c && influxTargetInit(t, port, numQueueEntries) != 0) {
+			EPRINTFN("influxtarget: init failed for \"%s\"",t->spec);
+			exit(1);
+		}
+
+	if (influxTargets) {
+		iFormatter = influxdb_post_init (NULL, 0, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, 0);
+		influxdb_post_setPrecision(iFormatter, influxPrecision);
+		influxdb_flushPolicy_init(&influxCollectPolicy, influxMaxPoints, influxMaxBytes, queryIntervalSecs, influxMinIntervalSecs);
+		for (influxTier_t *tier = influxTiers; tier; tier = tier->next) influxTierInit(tier, time(NULL));
+	} else if (influxTiers) {
+		EPRINTFN("influxrollup requires an influx target");
+		exit(1);
 	}
 
 	argParse_free (a);
@@ -307,173 +1033,649 @@ void sigusr2_handler(int signum) {
 }
 
 
-#define INITIAL_BUFFER_LEN 256
+// output buffer for mqtt, kept between publishes
+char *mqttBuf;
+int mqttBufSize;
+
+// fixed parts of the mqtt payload, the device specific part is created once per device
+#define MQTT_JSON_TEMP_KEY ", \"Temp\":"
+#define MQTT_JSON_HUMIDITY_KEY ", \"Humidity\":"
+#define MQTT_JSON_BATT_KEY ", \"BattVoltage\":"
+#define MQTT_JSON_PRESSURE_KEY ", \"Pressure\":"
+#define MQTT_JSON_END "}"
+#define MQTT_MAX_VALUE_LEN 32
+#define MQTT_JSON_DERIVED_MAX_LEN (sizeof(", \"AbsHumidity\":") + MQTT_MAX_VALUE_LEN)
+const char * mqttJsonDerivedKeys[derived_numMetrics] = {", \"DewPoint\":",", \"AbsHumidity\":",", \"VPD\":"};
+// max length written by mqttAppendValues
+#define MQTT_VALUES_MAX_LEN (sizeof(MQTT_JSON_HUMIDITY_KEY MQTT_JSON_BATT_KEY MQTT_JSON_PRESSURE_KEY MQTT_JSON_END) + 4 * MQTT_MAX_VALUE_LEN + derived_numMetrics * MQTT_JSON_DERIVED_MAX_LEN)
+
+#define MQTT_COPY(p,s,len) { memcpy(p,s,len); p += len; }
+#define MQTT_COPYSTR(p,s) MQTT_COPY(p,s,sizeof(s)-1)
+
+// bulk mode, all devices published within a main loop cycle are sent in one message
+mqtt_topicT mqttBulkTopic;  // mqttprefix + mqttbulk, topic is NULL if bulk mode is disabled
+char *mqttBulkBuf;
+int mqttBulkBufSize;
+int mqttBulkLen;
+int mqttBulkNumDevices;
+dataRead_t **mqttBulkDevices;  // devices in the pending bulk message, their state is updated once it is published
+int mqttBulkDevicesSize;
+
+static char * mqttJsonEscape(char *p, const char *s) {
+	while (*s) {
+		if (*s == '"' || *s == '\\') *p++ = '\\';
+		*p++ = *s++;
+	}
+	return p;
+}
 
-void appendToStr (const char *src, char **dest, int *len, int *bufsize) {
-	int srclen;
+// (re)creates the payload templates of a device
+int mqttTemplateInit(dataRead_t *dr) {
+	const char *name = DEVICE_NAME(dr);
+	char *p;
+	int len;
+
+	free(dr->mqttTemplate);
+	free(dr->mqttBulkKey);
+
+	// worst case all chars of measurement and name need to be escaped
+	len = 2 * ((influxMeasurement ? strlen(influxMeasurement) : 0) + strlen(name)) + sizeof("{\"name\":\".\"" MQTT_JSON_TEMP_KEY);
+	dr->mqttTemplate = (char *)malloc(len);
+	if (!dr->mqttTemplate) return -1;
+	p = dr->mqttTemplate;
+	MQTT_COPYSTR(p,"{\"name\":\"");
+	if (influxMeasurement) {
+		p = mqttJsonEscape(p,influxMeasurement);
+		*p++ = '.';
+	}
+	p = mqttJsonEscape(p,name);
+	*p++ = '"';
+	MQTT_COPYSTR(p,MQTT_JSON_TEMP_KEY);
+	dr->mqttTemplateLen = p - dr->mqttTemplate;
+
+	// "name":{"Temp": for bulk messages
+	len = 2 * strlen(name) + sizeof("\"\":{\"Temp\":");
+	dr->mqttBulkKey = (char *)malloc(len);
+	if (!dr->mqttBulkKey) return -1;
+	p = dr->mqttBulkKey;
+	*p++ = '"';
+	p = mqttJsonEscape(p,name);
+	MQTT_COPYSTR(p,"\":{\"Temp\":");
+	dr->mqttBulkKeyLen = p - dr->mqttBulkKey;
+	return 0;
+}
 
-	if (src == NULL) return;
-	if (*src == 0) return;
 
-	srclen = strlen(src);
-	if (*len + srclen + 1 > *bufsize) {
-		*bufsize *= 2;
-		//printf("Realloc to %d, len=%d, srclen: %d %x %x %s\n",*bufsize,*len,srclen,dest,*dest,*dest);
-		*dest = (char *)realloc(*dest,*bufsize);
-		if (*dest == NULL) { EPRINTF("Out of memory in appendToStr"); exit(1); };
-	}
-	strcat(*dest,src);
-	*len += srclen;
+// topic and templates are created on the first publish and if the name or prefix changes
+static void mqttTopicCheck(dataRead_t *dr) {
+	int rc = mqtt_topic_set(&dr->mqttTopic,mqttprefix,DEVICE_NAME(dr));
+
+	if (rc > 0) rc = mqttTemplateInit(dr);
+	if (rc < 0) { EPRINTFN("out of memory"); exit(1); }
+}
+
+
+// appends the values following the Temp key, p needs MQTT_VALUES_MAX_LEN bytes
+static char * mqttAppendValues(char *p, dataRead_t *dr) {
+	p += influxdb_fmtFixed(p,dr->dataPublish.temperature,2);
+	MQTT_COPYSTR(p,MQTT_JSON_HUMIDITY_KEY);
+	p += influxdb_fmtFixed(p,dr->dataPublish.humidity,1);
+	MQTT_COPYSTR(p,MQTT_JSON_BATT_KEY);
+	p += influxdb_fmtFixed(p,(double)dr->dataPublish.batteryVoltage/1000,2);
+	MQTT_COPYSTR(p,MQTT_JSON_PRESSURE_KEY);
+	p += influxdb_fmtFixed(p,dr->dataPublish.pressure,0);
+	if (derivedNumEnabled)
+		for (int m=0;m<derived_numMetrics;m++) {
+			if (!derivedEnabled[m]) continue;
+			MQTT_COPY(p,mqttJsonDerivedKeys[m],strlen(mqttJsonDerivedKeys[m]));
+			p += influxdb_fmtFixed(p,dr->dataPublish.derived[m],statsFieldPrecision[STATS_DERIVED(m)]);
+		}
+	MQTT_COPYSTR(p,MQTT_JSON_END);
+	*p = 0;
+	return p;
 }
 
 
-#define APPEND(SRC) appendToStr(SRC,&buf,&buflen,&bufsize)
-#define APPENDFLOAT(name,value,dec) sprintf(tempStr,"%s\"" #name "\"" ":%1." #dec "f",first?"":", ",value); APPEND(tempStr)
-#define APPENDINT(name,value) sprintf(tempStr,"%s\"" #name "\"" ":%d",first?"":", ",value); APPEND(tempStr)
 int mqttSendData (dataRead_t * dr,int dryrun) {
-	int bufsize = INITIAL_BUFFER_LEN;
-	char *buf;
-	int buflen = 0;
 	int rc = 0;
-	char tempStr[255];
-	char *name,*s;
-	int first = 1;
-
-#if 0
-	double deltaTemperature = dr->dataLastSent.temperature-dr->dataCurr.temperature;
-    double deltaHumidity = dr->dataLastSent.humidity-dr->dataCurr.humidity;
-    int deltaPressure = dr->dataLastSent.pressure-dr->dataCurr.pressure;
-    int deltaBatteryVoltage = dr->dataLastSent.batteryVoltage-dr->dataCurr.batteryVoltage;
-    // we do not need the full resolution
-    if (fabs(deltaTemperature) < 0.09 && fabs(deltaHumidity) < 0.09 && abs(deltaPressure) < 10 && abs (deltaBatteryVoltage < 50)) {
-		dr->updated = 0;
-		return 0;
-    }
-#endif // 0
-
-	buf = (char *)malloc(bufsize);
-	if (buf == NULL) return -1;
-	*buf=0;
+	char *p;
+	int needed;
+
+	mqttTopicCheck(dr);
+	needed = dr->mqttTemplateLen + MQTT_VALUES_MAX_LEN;
+	if (needed > mqttBufSize) {
+		mqttBuf = (char *)realloc(mqttBuf,needed);
+		if (!mqttBuf) { EPRINTFN("out of memory"); exit(1); }
+		mqttBufSize = needed;
+	}
 
-
-	APPEND("{\"name\":\"");
-	if (influxMeasurement) {
-			APPEND(influxMeasurement); APPEND(".");
-	}
-	APPEND(dr->name);
-	APPEND("\", ");
-	APPENDFLOAT(Temp,dr->dataCurr.temperature,2); first--;
-    APPENDFLOAT(Humidity,dr->dataCurr.humidity,1);
-    APPENDFLOAT(BattVoltage,(double)dr->dataCurr.batteryVoltage/1000,2);
-    APPENDINT(Pressure,dr->dataCurr.pressure);
-    dr->dataLastSent = dr->dataCurr;
-    APPEND("}");
-
-    if (dr->name) {
-        name = strdup(dr->name);
-    } else {
-        // use mac address
-        sprintf(tempStr,"%012lx",dr->mac);
-        s = &tempStr[0];
-        while (*s) {
-            *s = toupper(*s);
-            s++;
-        }
-        name = strdup(tempStr);
-    }
+	// one pass into the reused buffer
+	p = mqttBuf;
+	MQTT_COPY(p,dr->mqttTemplate,dr->mqttTemplateLen);
+	p = mqttAppendValues(p,dr);
 
 	if (dryrun) {
-		printf("Dryrun MQTT - %s = %s\n",name,buf);
+		printf("Dryrun MQTT - %s = %s\n",DEVICE_NAME(dr),mqttBuf);
 	} else {
-		mClient->topicPrefix = mqttprefix;
-		rc = mqtt_pub_strF (mClient,name, 250, mqttQOS,mqttRetain, buf);
-		mClient->topicPrefix = NULL;
+		rc = mqtt_pub_topic (mClient, &dr->mqttTopic, mqttBuf, p - mqttBuf, mqttPubWaitMs, mqttQOS,mqttRetain);
+		if (rc == MQTTCLIENT_MAX_MESSAGES_INFLIGHT && !mqttPubWaitMs) {
+			VPRINTFN(2,"mqtt publish of %s deferred, max in flight reached",DEVICE_NAME(dr));
+			return rc;
+		}
 		if (rc != MQTTCLIENT_SUCCESS && rc != MQTT_RECONNECTED) {
 			LOGN(0,"mqtt publish failed with rc: %d",rc);
-			free(buf);
-			free(name);
 			return rc;
 		}
-		//printf("mqtt_pub_strF: rc: %d\n",rc);
+		//printf("mqtt_pub: rc: %d\n",rc);
+	}
+
+	dr->dataLastSent = dr->dataPublish;
+	return rc;
+}
+
+
+// publishes the pending bulk message {"name1":{...},"name2":{...}}
+int mqttBulkFlush(int dryrun) {
+	int rc = 0;
+	int i,failed = 0;
+
+	if (!mqttBulkLen) return 0;
+	mqttBulkBuf[mqttBulkLen++] = '}';
+	mqttBulkBuf[mqttBulkLen] = 0;
+	if (dryrun) {
+		printf("Dryrun MQTT - %s = %s\n",mqttBulkTopic.topic,mqttBulkBuf);
+	} else {
+		rc = mqtt_pub_topic (mClient, &mqttBulkTopic, mqttBulkBuf, mqttBulkLen, mqttPubWaitMs, mqttQOS,mqttRetain);
+		if (rc != MQTTCLIENT_SUCCESS && rc != MQTT_RECONNECTED) {
+			LOGN(0,"mqtt bulk publish of %d devices failed with rc: %d",mqttBulkNumDevices,rc);
+			failed = 1;
+			pubNumBulkFailed++;
+		} else {
+			VPRINTFN(2,"mqtt bulk publish: %d devices, %d bytes",mqttBulkNumDevices,mqttBulkLen);
+		}
 	}
+	for (i=0;i<mqttBulkNumDevices;i++) {
+		if (failed) mqttBulkDevices[i]->pubResend = 1;
+		else mqttBulkDevices[i]->dataLastSent = mqttBulkDevices[i]->dataPublish;
+	}
+	mqttBulkLen = 0;
+	mqttBulkNumDevices = 0;
+	return rc;
+}
 
-	dr->dataLastSent = dr->dataCurr;
 
-	free(buf);
-	free(name);
+// adds a device to the bulk message, the message is published first if mqttBulkMaxSize would be exceeded
+int mqttBulkAdd(dataRead_t *dr, int dryrun) {
+	int rc = 0;
+	int needed;
+	char *p;
+
+	mqttTopicCheck(dr);
+	needed = 1 + dr->mqttBulkKeyLen + MQTT_VALUES_MAX_LEN + 1;	// , or {, key, values, }
+	if (mqttBulkLen && mqttBulkLen + needed > mqttBulkMaxSize) rc = mqttBulkFlush(dryrun);
+	if (mqttBulkLen + needed > mqttBulkBufSize) {
+		mqttBulkBufSize = mqttBulkLen + needed > mqttBulkMaxSize ? mqttBulkLen + needed : mqttBulkMaxSize;
+		mqttBulkBuf = (char *)realloc(mqttBulkBuf,mqttBulkBufSize);
+		if (!mqttBulkBuf) { EPRINTFN("out of memory"); exit(1); }
+	}
+	if (mqttBulkNumDevices >= mqttBulkDevicesSize) {
+		mqttBulkDevicesSize = mqttBulkDevicesSize ? mqttBulkDevicesSize * 2 : 64;
+		mqttBulkDevices = (dataRead_t **)realloc(mqttBulkDevices,mqttBulkDevicesSize * sizeof(dataRead_t *));
+		if (!mqttBulkDevices) { EPRINTFN("out of memory"); exit(1); }
+	}
+	p = mqttBulkBuf + mqttBulkLen;
+	*p++ = mqttBulkLen ? ',' : '{';
+	MQTT_COPY(p,dr->mqttBulkKey,dr->mqttBulkKeyLen);
+	p = mqttAppendValues(p,dr);
+	mqttBulkLen = p - mqttBulkBuf;
+	mqttBulkDevices[mqttBulkNumDevices++] = dr;
+	return rc;
+}
+
+
+// CBOR payload, an array of integers in fixed order:
+// [schema version, temperature in 0.01 C, humidity in 0.01 %, battery in mV, pressure in Pa]
+#define MQTT_CBOR_SCHEMA 1
+#define MQTT_CBOR_NUM_ITEMS 5
+#define MQTT_CBOR_MAX_LEN (CBOR_MAX_ITEM_LEN * (MQTT_CBOR_NUM_ITEMS + 1))
+
+static int mqttCborEncode(uint8_t *buf, const sensorData_t *d) {
+	uint8_t *p = buf;
+
+	p = cbor_putArray(p,MQTT_CBOR_NUM_ITEMS);
+	p = cbor_putUint(p,MQTT_CBOR_SCHEMA);
+	p = cbor_putInt(p,lround(d->temperature * 100));
+	p = cbor_putInt(p,lround(d->humidity * 100));
+	p = cbor_putInt(p,d->batteryVoltage);
+	p = cbor_putInt(p,d->pressure);
+	return p - buf;
+}
+
+
+int mqttSendCbor (dataRead_t * dr,int dryrun) {
+	uint8_t buf[MQTT_CBOR_MAX_LEN];
+	int rc = 0;
+	int len;
+
+	if (mqtt_topic_set(&dr->mqttCborTopic,mqttCborPrefix,DEVICE_NAME(dr)) < 0) { EPRINTFN("out of memory"); exit(1); }
+	len = mqttCborEncode(buf,&dr->dataPublish);
+	if (dryrun) {
+		printf("Dryrun MQTT - %s = CBOR",dr->mqttCborTopic.topic);
+		for (int i=0;i<len;i++) printf(" %02x",buf[i]);
+		printf("\n");
+	} else {
+		rc = mqtt_pub_topic (mClient, &dr->mqttCborTopic, (const char *)buf, len, mqttPubWaitMs, mqttQOS,mqttRetain);
+		if (rc == MQTTCLIENT_MAX_MESSAGES_INFLIGHT && !mqttPubWaitMs) return rc;
+		if (rc != MQTTCLIENT_SUCCESS && rc != MQTT_RECONNECTED) {
+			LOGN(0,"mqtt CBOR publish failed with rc: %d",rc);
+			return rc;
+		}
+	}
+	dr->dataLastSent = dr->dataPublish;
 	return rc;
 }
 
 
+#define BENCHMARK_LOOPS 1000000
+#define NANO_PER_SEC 1000000000.0
+
+static double benchmarkElapsedNs(const struct timespec *start) {
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * NANO_PER_SEC + (end.tv_nsec - start->tv_nsec);
+}
+
+// the formulas of derived_compute using libm
+static void benchmarkDerivedLibm(double temp, double humidity, double *dewPoint, double *absHumidity, double *vpd) {
+	double gammaSat = 17.625 * temp / (243.04 + temp);
+	double gamma = log(humidity * 0.01) + gammaSat;
+	double es = 6.1094 * exp(gammaSat);
+
+	*dewPoint = 243.04 * gamma / (17.625 - gamma);
+	*absHumidity = 216.7 * es * humidity * 0.01 / (273.15 + temp);
+	*vpd = (es - es * humidity * 0.01) * 0.1;
+}
+
+volatile double benchmarkSink;     // keeps results from being optimized away
+
+// derived metrics in batches of BENCHMARK_BATCH devices compared to libm
+#define BENCHMARK_BATCH 1024
+static void benchmarkDerived() {
+	static double temp[BENCHMARK_BATCH],humidity[BENCHMARK_BATCH],out[derived_numMetrics][BENCHMARK_BATCH];
+	struct timespec start;
+	double batchNs,libmNs,maxErr = 0,dewPoint,absHumidity,vpd;
+	int i,k;
+
+	for (i=0;i<BENCHMARK_BATCH;i++) {
+		temp[i] = -30 + i * 70.0 / BENCHMARK_BATCH;
+		humidity[i] = 1 + (i * 37 % 100);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (k=0;k<BENCHMARK_LOOPS/BENCHMARK_BATCH;k++) {
+		derived_compute(BENCHMARK_BATCH,temp,humidity,out[derived_dewpoint],out[derived_abshumidity],out[derived_vpd]);
+		benchmarkSink = out[derived_vpd][k % BENCHMARK_BATCH];
+	}
+	batchNs = benchmarkElapsedNs(&start) / (k * BENCHMARK_BATCH);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (k=0;k<BENCHMARK_LOOPS/BENCHMARK_BATCH;k++)
+		for (i=0;i<BENCHMARK_BATCH;i++) {
+			benchmarkDerivedLibm(temp[i],humidity[i],&dewPoint,&absHumidity,&vpd);
+			benchmarkSink = dewPoint + absHumidity + vpd;
+		}
+	libmNs = benchmarkElapsedNs(&start) / (k * BENCHMARK_BATCH);
+
+	for (i=0;i<BENCHMARK_BATCH;i++) {
+		benchmarkDerivedLibm(temp[i],humidity[i],&dewPoint,&absHumidity,&vpd);
+		if (fabs(dewPoint - out[derived_dewpoint][i]) > maxErr) maxErr = fabs(dewPoint - out[derived_dewpoint][i]);
+	}
+	printf("derived metrics in batches of %d devices\n",BENCHMARK_BATCH);
+	printf("batch: %6.1f ns/device, libm: %6.1f ns/device, max dew point difference: %.1e\n",batchNs,libmNs,maxErr);
+}
+
+
+// encodes a device payload with the JSON and the CBOR encoder, publishing is not included
+int benchmarkCallback(argParse_handleT *a, char * arg) {
+	dataRead_t dr;
+	uint8_t cborBuf[MQTT_CBOR_MAX_LEN];
+	struct timespec start;
+	double jsonNs,cborNs;
+	size_t jsonBytes = 0, cborBytes = 0;
+	char *p;
+	int i;
+
+	memset(&dr,0,sizeof(dr));
+	strcpy(dr.macStr,"C1A2B3C4D500");
+	dr.name = (char *)"Kitchen";
+	dr.dataPublish.humidity = 45.5;
+	dr.dataPublish.batteryVoltage = 2950;
+	dr.dataPublish.pressure = 101325;
+	if (mqttTemplateInit(&dr) != 0) { EPRINTFN("out of memory"); exit(1); }
+	mqttBufSize = dr.mqttTemplateLen + MQTT_VALUES_MAX_LEN;
+	mqttBuf = (char *)malloc(mqttBufSize);
+	if (!mqttBuf) { EPRINTFN("out of memory"); exit(1); }
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i=0;i<BENCHMARK_LOOPS;i++) {
+		dr.dataPublish.temperature = 20 + (i & 1023) * 0.01;
+		p = mqttBuf;
+		MQTT_COPY(p,dr.mqttTemplate,dr.mqttTemplateLen);
+		p = mqttAppendValues(p,&dr);
+		jsonBytes += p - mqttBuf;
+	}
+	jsonNs = benchmarkElapsedNs(&start) / BENCHMARK_LOOPS;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i=0;i<BENCHMARK_LOOPS;i++) {
+		dr.dataPublish.temperature = 20 + (i & 1023) * 0.01;
+		cborBytes += mqttCborEncode(cborBuf,&dr.dataPublish);
+	}
+	cborNs = benchmarkElapsedNs(&start) / BENCHMARK_LOOPS;
+
+	printf("%d payloads per encoder\n",BENCHMARK_LOOPS);
+	printf("JSON: %6.1f ns/payload, %5.1f bytes/payload\n",jsonNs,(double)jsonBytes / BENCHMARK_LOOPS);
+	printf("CBOR: %6.1f ns/payload, %5.1f bytes/payload\n",cborNs,(double)cborBytes / BENCHMARK_LOOPS);
+	benchmarkDerived();
+	free(dr.mqttTemplate);
+	free(dr.mqttBulkKey);
+	exit(0);
+}
+
+
+
+// one line with the selected statistics, used for the raw data and the rollup tiers
+static int influxAppendFields (influx_client_t* c, const char *prefix, const influxField_t *fields, const fieldStats_t *stats, uint64_t timestamp) {
+	if (influxdb_format_line(c,INFLUX_PREFIX(prefix),INFLUX_END) < 0) return -1;
+	for (const influxField_t *f = fields; f; f = f->next)
+		if (influxdb_append_float(c,f->key,f->keyLen,fieldStats_get(&stats[f->field],f->stat),f->precision) < 0) return -1;
+	return influxdb_format_line(c,INFLUX_TS(timestamp),INFLUX_END);
+}
+
 
 int influxAppendData (influx_client_t* c, dataRead_t * data, uint64_t timestamp) {
+	size_t startLen;
 
-	if (data->dataInflux.temperature < -900) {
-		//EPRINTFN("influxAppendData: internal program error, would write -999 as temp");
-		// can happen if the mqqt sender was disconnected, will be ok again after a reconnect
+	// all fields are sampled together, nothing received since the last write
+	if (!data->influxStats[stats_temp].count) {
+		data->influxPendingSince = 0;
 		return 0;
 	}
-	influxdb_format_line(c,
-                INFLUX_MEAS(influxMeasurement),
-                INFLUX_TAG(influxTagName, data->name),
-				INFLUX_F_FLT("Temp",data->dataInflux.temperature,1),
-				INFLUX_F_FLT("BattVoltage",(float)data->dataInflux.batteryVoltage/1000,1),
-				INFLUX_F_FLT("Humidity",data->dataInflux.humidity,1),
-				INFLUX_TS(timestamp),
-				INFLUX_END);
-    data->dataInflux.temperature = -998;
-    data->dataInflux.humidity = 0;
+	if (!data->influxPrefix) {
+		data->influxPrefix = influxdb_format_prefix(influxMeasurement, influxTagName, DEVICE_NAME(data), NULL);
+		if (!data->influxPrefix) return -1;
+	}
+	startLen = c->influxBufUsed;
+	if (influxAppendFields(c, data->influxPrefix, influxFields, data->influxStats, timestamp) < 0) return -1;
+	data->influxLineLen = c->influxBufUsed - startLen;
+	memset(data->influxStats,0,sizeof(data->influxStats));
+    data->influxPendingSince = 0;
 	return 0;
 }
 
 
-void GrafanaWriteData (influx_client_t *c) {
-	if (!c) return;
+// appends one line per acceleration sample in g and empties the ring, returns the number of lines or <0
+int influxAppendAccel (influx_client_t* c, dataRead_t * data) {
+	accelRing_t *r = &data->accel;
+	accelSample_t s;
+	uint64_t ms;
+	double v[accel_numFields],magnitude;
+	int i,f;
 
-	influxdb_post_freeBuffer(c);
-	dataRead_t *dataRead = mqttDataRead;
+	if (!r->count) return 0;
+	if (!data->influxAccelPrefix) {
+		data->influxAccelPrefix = influxdb_format_prefix(accelMeasurement, influxTagName, DEVICE_NAME(data), NULL);
+		if (!data->influxAccelPrefix) return -1;
+	}
+	for (i=0;i<r->count;i++) {
+		ms = accelRing_get(r,i,&s);
+		v[accel_x] = s.x / 1000.0;
+		v[accel_y] = s.y / 1000.0;
+		v[accel_z] = s.z / 1000.0;
+		magnitude = sqrt(v[accel_x] * v[accel_x] + v[accel_y] * v[accel_y] + v[accel_z] * v[accel_z]);
+		v[accel_magnitude] = magnitude;
+		// angle between the z axis and the acceleration, 0 if lying flat
+		v[accel_tilt] = magnitude > 0 ? acos(v[accel_z] / magnitude) * 180 / M_PI : 0;
+		if (influxdb_format_line(c,INFLUX_PREFIX(data->influxAccelPrefix),INFLUX_END) < 0) return -1;
+		for (f=0;f<accel_numFields;f++)
+			if (accelFields[f] && influxdb_append_float(c,accelFieldKeys[f],strlen(accelFieldKeys[f]),v[f],f == accel_tilt ? 1 : 3) < 0) return -1;
+		if (influxdb_format_line(c,INFLUX_TS(ms * 1000000),INFLUX_END) < 0) return -1;
+	}
+	accelNumWritten += r->count;
+	accelRing_clear(r);
+	return i;
+}
+
+
+// writes the closed windows of the rollup tiers timestamped with the window start, called with mqttDataLock held
+void influxTiersWrite(time_t now) {
+	influxTierData_t *td;
+	int points;
+
+	for (influxTier_t *tier = influxTiers; tier; tier = tier->next) {
+		if (now < tier->windowEnd) continue;
+		uint64_t timestamp = (uint64_t)(tier->windowEnd - tier->intervalSecs) * 1000000000ULL;
+		points = 0;
+		influxdb_post_resetBuffer(tier->formatter);
+		for (dataRead_t *dr = mqttDataRead; dr; dr = dr->next) {
+			if (!dr->tierData) continue;
+			td = &dr->tierData[tier->index];
+			if (!td->stats[stats_temp].count) continue;
+			if (!td->influxPrefix) {
+				td->influxPrefix = influxdb_format_prefix(tier->measurement, influxTagName, DEVICE_NAME(dr), NULL);
+				if (!td->influxPrefix) { EPRINTFN("out of memory"); break; }
+			}
+			if (influxAppendFields(tier->formatter, td->influxPrefix, tier->fields, td->stats, timestamp) < 0) {
+				EPRINTFN("influx rollup %s: failed to format data of %s",tier->name,DEVICE_NAME(dr));
+				break;
+			}
+			memset(td->stats,0,sizeof(td->stats));
+			points++;
+		}
+		// windows without data are skipped, e.g. after a suspend
+		tier->windowEnd = (now / tier->intervalSecs + 1) * tier->intervalSecs;
+		if (!points) continue;
+		tier->numWrites++;
+		tier->numPoints += points;
+		VPRINTFN(1,"influx rollup %s: %d points, %zu bytes",tier->name,points,tier->formatter->influxBufUsed);
+		if (dryrun)
+			printf("\nDryrun: would send rollup %s to influxdb:\n%s\n",tier->name,tier->formatter->influxBuf);
+		else {
+			influx_sharedBuf_t *buf = influxdb_sharedBuf_detach(tier->formatter, points);
+			for (influx_client_t **c = tier->targets; *c; c++) influxdb_post_enqueue(*c, buf);
+			influxdb_sharedBuf_release(buf);
+		}
+		influxdb_post_resetBuffer(tier->formatter);
+	}
+}
+
+
+// values are compared with the precision posted
+#define GRAFANA_CHANGED(a,b,scale) (lround((a)*(scale)) != lround((b)*(scale)))
+
+const char * grafanaFieldSuffix[grafana_numFields] = {".temp",".U",".Humidity",".DewPoint",".AbsHumidity",".VPD"};
+
+int grafanaKeysInit(dataRead_t *dr) {
 	char fieldName[255];
+
+	for (int i=0;i<grafana_numFields;i++) {
+		snprintf(fieldName,sizeof(fieldName),"%s%s",DEVICE_NAME(dr),grafanaFieldSuffix[i]);
+		dr->grafanaKey[i] = influxdb_format_key(fieldName,&dr->grafanaKeyLen[i]);
+		if (!dr->grafanaKey[i]) return -1;
+	}
+	return 0;
+}
+
+#define GRAFANA_APPEND(field,value,precision) { \
+		rc = influxdb_append_float(c,dataRead->grafanaKey[field],dataRead->grafanaKeyLen[field],value,precision); \
+		if (rc < 0) { EPRINTFN("influxdb_append_float failed, rc:%d, %s",rc,dataRead->grafanaKey[field]); exit(1); } \
+		numFields++; \
+	}
+
+// posts fields changed since the last post or all fields if full is set, returns 0 on success
+int GrafanaWriteData (influx_client_t *g, int full) {
+	if (!g) return 0;
+
+	influx_client_t *c = gFormatter;
+	dataRead_t *dataRead = mqttDataRead;
 	int rc;
-	int numLines = 0;
+	int numFields = 0;
+	int all;
 
 	dataRead = mqttDataRead;
-	if (!dataRead) return;
+	if (!dataRead) return 0;
 
-	influxdb_post_freeBuffer(c);
+	influxdb_post_resetBuffer(c);
 	rc = influxdb_format_line(c,INFLUX_MEAS(influxMeasurement),INFLUX_END);
 	if (rc < 0) { EPRINTFN("influxdb_format_line failed, rc:%d, INFLUX_MEAS",rc); exit(1); }
 
 	while(dataRead) {
-		snprintf(fieldName,sizeof(fieldName),"%s.temp",dataRead->name);	rc = influxdb_format_line(c,INFLUX_F_FLT(fieldName,dataRead->dataCurr.temperature,1),INFLUX_END);
-		if (rc < 0) { EPRINTFN("influxdb_format_line failed, rc:%d, %s",rc,fieldName); exit(1); }
-		snprintf(fieldName,sizeof(fieldName), "%s.U",dataRead->name); rc = influxdb_format_line(c,INFLUX_F_FLT(fieldName,(float)dataRead->dataCurr.batteryVoltage/1000,2),INFLUX_END);
-		if (rc < 0) { EPRINTFN("influxdb_format_line failed, rc:%d, %s",rc,fieldName); exit(1); }
-		snprintf(fieldName,sizeof(fieldName), "%s.Humidity",dataRead->name); rc = influxdb_format_line(c,INFLUX_F_FLT(fieldName,dataRead->dataCurr.humidity,1),INFLUX_END);
-		if (rc < 0) { EPRINTFN("influxdb_format_line failed, rc:%d, %s",rc,fieldName); exit(1); }
-		numLines += 3;
+		if (!dataRead->lastPublishMs) {		// no values released yet
+			dataRead = dataRead->next;
+			continue;
+		}
+		if (!dataRead->grafanaKey[0] && grafanaKeysInit(dataRead) != 0) { EPRINTFN("out of memory"); exit(1); }
+		all = full || !dataRead->grafanaSent;
+		if (all || GRAFANA_CHANGED(dataRead->dataPublish.temperature,dataRead->dataGrafana.temperature,10))
+			GRAFANA_APPEND(grafana_temp,dataRead->dataPublish.temperature,1);
+		if (all || GRAFANA_CHANGED(dataRead->dataPublish.batteryVoltage,dataRead->dataGrafana.batteryVoltage,0.1))
+			GRAFANA_APPEND(grafana_U,(double)dataRead->dataPublish.batteryVoltage/1000,2);
+		if (all || GRAFANA_CHANGED(dataRead->dataPublish.humidity,dataRead->dataGrafana.humidity,10))
+			GRAFANA_APPEND(grafana_humidity,dataRead->dataPublish.humidity,1);
+		for (int m=0;m<derived_numMetrics;m++)
+			if (derivedEnabled[m] && (all || GRAFANA_CHANGED(dataRead->dataPublish.derived[m],dataRead->dataGrafana.derived[m],derivedScale[m])))
+				GRAFANA_APPEND(GRAFANA_DERIVED(m),dataRead->dataPublish.derived[m],statsFieldPrecision[STATS_DERIVED(m)]);
+		dataRead->dataGrafana = dataRead->dataPublish;
+		dataRead->grafanaSent = 1;
 		dataRead = dataRead->next;
 	}
+	if (!numFields) {
+		VPRINTFN(2,"nothing changed, nothing to send to grafana");
+		influxdb_post_resetBuffer(c);
+		return 0;
+	}
 	rc = influxdb_format_line(c,INFLUX_TSNOW,INFLUX_END);
 	if (rc < 0) { EPRINTFN("influxdb_format_line failed, rc:%d, TS_NOW",rc); exit(1); }
 
 	if (dryrun) {
-		if (c->influxBufLen) {
-			printf("\nDryrun: would send to grafana:\n%s\n",c->influxBuf);
-			influxdb_post_freeBuffer(c);
-		} else printf("nothing to be posted to Grafana\n");
+		printf("\nDryrun: would send to grafana:\n%s\n",c->influxBuf);
+		influxdb_post_resetBuffer(c);
+		return 0;
+	}
+	VPRINTF(3,"Queueing for Grafana:\n%s\n",c->influxBuf);
+	// posted by the websocket writer thread, frames are merged while grafana is not reachable
+	influx_sharedBuf_t *buf = influxdb_sharedBuf_detach(c, numFields);
+	rc = influxdb_post_enqueue(g, buf);
+	influxdb_sharedBuf_release(buf);
+	if (rc != 0) {
+		VPRINTFN(1,"grafana queue full, %d values dropped",numFields);
 	} else {
-		if (c->influxBufLen) {
-			VPRINTF(3,"Posting to Grafana:\n%s\n",c->influxBuf);
-			rc = influxdb_post_http_line(c);
-			if (rc != 0) {
-				EPRINTFN("Error: influxdb_post_http_line to grafana failed with rc %d",rc);
-			} else {
-				VPRINTFN(1,"%d values posted to grafana",numLines);
-			}
-		} else {
-			VPRINTFN(2,"nothing to send to grafana");
+		VPRINTFN(1,"%d %svalues queued for grafana",numFields,full ? "" : "changed ");
+	}
+	return rc;
+}
+
+
+// computes the derived metrics of the samples received since the last call in one batch, called with mqttDataLock held
+void derivedUpdate() {
+	derivedBatch_t *b = &derivedBatch;
+	dataRead_t *dr;
+	double v;
+	int i,m,t,n = b->n;
+
+	if (!n) return;
+	b->n = 0;
+	// the samples are gathered into arrays by the receiver, the computation is vectorized by the compiler
+	derived_compute(n, b->temp, b->humidity, b->values[derived_dewpoint], b->values[derived_abshumidity], b->values[derived_vpd]);
+
+	for (i=0;i<n;i++) {
+		dr = b->dr[i];
+		for (m=0;m<derived_numMetrics;m++) {
+			if (!derivedEnabled[m]) continue;
+			v = b->values[m][i];
+			dr->dataCurr.derived[m] = v;
+			fieldStats_add(&dr->influxStats[STATS_DERIVED(m)],v);
+			if (dr->tierData)
+				for (t=0;t<influxNumTiers;t++) fieldStats_add(&dr->tierData[t].stats[STATS_DERIVED(m)],v);
+		}
+	}
+	VPRINTFN(3,"derived metrics computed for %d samples",n);
+}
+
+
+#define PUB_PENDING_JSON 1
+#define PUB_PENDING_CBOR 2
+#define PUB_PENDING_ALL (PUB_PENDING_JSON | PUB_PENDING_CBOR)
+
+// releases the latest values of a device for mqtt and grafana, called with mqttDataLock held
+void publishDevice(dataRead_t *dr, uint64_t nowMs) {
+	int pending = PUB_PENDING_ALL;
+
+	if (dr->pubDeferred) {
+		dr->pubDeferred = 0;
+		pubNumDeferred--;
+		// payloads already sent are not repeated, newer values coalesced meanwhile reset pubPending
+		pending = dr->pubPending;
+	}
+	dr->dataPublish = dr->dataCurr;
+	dr->lastPublishMs = nowMs ? nowMs : 1;
+	dr->pubResend = 0;
+	pubNumPublished++;
+	if (mClient && (mqttprefix || mqttCborPrefix)) {
+		int rc = 0;
+
+		if (pending & PUB_PENDING_JSON) {
+			if (mqttBulkTopic.topic) mqttBulkAdd (dr,dryrun);
+			else if (mqttprefix) rc = mqttSendData (dr,dryrun);
+			if (rc != MQTTCLIENT_MAX_MESSAGES_INFLIGHT) pending &= ~PUB_PENDING_JSON;
+		}
+		if (mqttCborPrefix && (pending & PUB_PENDING_CBOR) && rc != MQTTCLIENT_MAX_MESSAGES_INFLIGHT) {
+			rc = mqttSendCbor (dr,dryrun);
+			if (rc != MQTTCLIENT_MAX_MESSAGES_INFLIGHT) pending &= ~PUB_PENDING_CBOR;
+		}
+		if (rc == MQTTCLIENT_MAX_MESSAGES_INFLIGHT) {
+			// not waiting for acks, they are processed by the same thread that waits for mqttDataLock
+			dr->pubPending = pending;
+			dr->pubDeferred = 1;
+			pubNumDeferred++;
+			timerWheel_add(&pubWheel,&dr->pubTimer,nowMs + PUB_RETRY_MS);
+		}
+	}
+}
+
+
+void pubTimerExpired(timerWheelNode_t *node, void *ctx) {
+	publishDevice((dataRead_t *)node->data, *(uint64_t *)ctx);
+}
+
+
+void logStatistics() {
+	if (pubNumUpdates) LOGN(0,"publish: %lu updates, %lu published, %lu coalesced, %d pending, %lu within deadband (%.1f%%), %lu forced by deadbandmaxsilence",
+		pubNumUpdates,pubNumPublished,pubNumCoalesced,pubWheel.numScheduled,pubNumSuppressed,100.0*pubNumSuppressed/pubNumUpdates,pubNumForced);
+	if (mqttBulkTopic.topic && pubNumBulkFailed) LOGN(0,"publish: %lu bulk messages failed, devices published again",pubNumBulkFailed);
+	if (mClient && (mqttprefix || mqttCborPrefix)) mqtt_pub_logStats(mClient);
+	if (iFormatter) influxdb_flushPolicy_logStats(&influxCollectPolicy,"influx");
+	if (spikeFilter.windowSize) {
+		int rejected = 0;
+		for (dataRead_t *dr = mqttDataRead; dr; dr = dr->next) {
+			if (!dr->spikeNumRejected) continue;
+			LOGN(0,"spike filter: %s: %d samples rejected",DEVICE_NAME(dr),dr->spikeNumRejected);
+			rejected += dr->spikeNumRejected;
 		}
+		LOGN(0,"spike filter: %d samples rejected",rejected);
 	}
+	if (accelRingSize) {
+		long added = 0, overwritten = 0;
+		for (dataRead_t *dr = mqttDataRead; dr; dr = dr->next) {
+			added += dr->accel.numAdded;
+			overwritten += dr->accel.numOverwritten;
+		}
+		LOGN(0,"acceleration: %ld samples, %ld written to influx, %ld overwritten before written",added,accelNumWritten,overwritten);
+	}
+	for (influxTier_t *tier = influxTiers; tier; tier = tier->next)
+		LOGN(0,"influx rollup %s: %d writes, %ld points",tier->name,tier->numWrites,tier->numPoints);
+	for (influxTarget_t *t = influxTargets; t; t = t->next) influxdb_post_logStats(t->c,t->c->name);
+	if (gClient) influxdb_post_logStats(gClient,"grafana");
 }
 
 
@@ -481,16 +1683,18 @@ void traceCallback(enum MQTTCLIENT_TRACE_LEVELS level, char *message) {
 	printf(message); printf("\n");
 }
 
-#define NANO_PER_SEC 1000000000.0
-#define GrafanaFourceCount 25
-
 int main(int argc, char *argv[]) {
 	int rc;
 	int64_t influxTimestamp;
-	time_t nextSendTime,now;
+	time_t nextSendTime,nextStatsTime,now;
+	influx_flushReason_t flushReason;
+	influxPending_t flushed;
 	int isFirstQuery = 1;
 	dataRead_t *dr;
-	int grafanaWriteCounter = 0;
+	time_t nextGrafanaRefresh = 0;
+	int grafanaFull = 1;
+	uint64_t nowMs;
+	time_t nextReceiverConnect = 0;
 
 	mqttTopic  = strdup(MQTT_DEF_TOPIC);
 
@@ -500,6 +1704,11 @@ int main(int argc, char *argv[]) {
 
 	if (!mClient->clientId) mClient->clientId = strdup(MQTT_CLIENT_ID);
 
+	if (timerWheel_init(&pubWheel, PUB_WHEEL_SLOTS, PUB_WHEEL_TICK_MS, timerWheel_nowMs()) != 0) {
+		EPRINTFN("out of memory");
+		exit(1);
+	}
+
 	mqttReceiverClientID = (char *)malloc(strlen(mClient->clientId)+1+4);  // -SUB
 	strcpy(mqttReceiverClientID,mClient->clientId);
 	strcat(mqttReceiverClientID,"-SUB");
@@ -508,29 +1717,65 @@ int main(int argc, char *argv[]) {
 		LOGN(0,"Warning: TimeT is less than 64 bit, this may fail after year 2038, recompile with newer kernel and glibc to avoid this");
 	}
 
-	if (!iClient) LOGN(0,"no influxdb host specified, influx sender disabled");
+	if (!influxTargets) {
+		LOGN(0,"no influxdb host specified, influx sender disabled");
+	} else if (!dryrun) {
+		for (influxTarget_t *t = influxTargets; t; t = t->next)
+			if (influxdb_post_startThread(t->c) != 0) exit(1);
+	}
 
 	if (!mClient->hostname) {
 		mqtt_pub_free(mClient);
 		mClient = NULL;
 		LOGN(0,"no mqtt host specified, mqtt sender disabled");
-		if (!iClient) {
+		if (!influxTargets) {
 			EPRINTFN("No mqtt host and no influxdb host specified, specify one or both");
 			exit(1);
 		}
 	} else {
+		mqtt_pub_setMaxInflight(mClient, mqttMaxInflight);
+		if (mqttVersion == 5) mqtt_pub_setV5(mClient, mqttMessageExpirySecs, mqttTopicAliasMax);
+		if (mqttPersistenceDir) {
+			if (access(mqttPersistenceDir, W_OK) != 0) {
+				EPRINTFN("mqttpersistencedir %s is not writable (%s)",mqttPersistenceDir,strerror(errno));
+				exit(1);
+			}
+			if (!mqttQOS) LOGN(0,"mqttpersistencedir has no effect with mqttqos 0");
+			if (mqtt_pub_setPersistence(mClient, mqttPersistenceDir) != 0) { EPRINTFN("out of memory"); exit(1); }
+		}
+		if (mqttSingleConnection) {
+			// messages from the gateway are received by the publisher, no separate receiver connection
+			mqttPubWaitMs = 0;
+			if (mqtt_pub_setSubscription(mClient, mqttTopic, QOS_SUBSCRIBE, mqttReceiverMsgArrived) != 0) { EPRINTFN("out of memory"); exit(1); }
+		}
+		if (mqttBulk && mqttprefix) {
+			if (mqtt_topic_set(&mqttBulkTopic,mqttprefix,mqttBulk) < 0) { EPRINTFN("out of memory"); exit(1); }
+			LOGN(0,"mqtt bulk mode, publishing to %s",mqttBulkTopic.topic);
+		}
         LOGN(0,"connecting to mqqt server %s",mClient->hostname);
-		rc = mqtt_pub_connect (mClient);
-		if (rc != 0) LOGN(0,"mqtt_pub_connect returned %d, will retry later",rc);
+		if (mqttSingleConnection) {
+			if (mqtt_pub_startReconnectThread(mClient) != 0) exit(1);
+		} else {
+			rc = mqtt_pub_connect (mClient);
+			if (rc != 0) LOGN(0,"mqtt_pub_connect returned %d, will retry later",rc);
+		}
 	}
 
 	if (ghost && gtoken && gpushid) {
 		gClient = influxdb_post_init_grafana (ghost, gport, gpushid, gtoken, gVerifyPeer);
+		if (gClient) {
+			free(gClient->name);
+			gClient->name = strdup("grafana");
+			influxdb_post_setPingInterval(gClient, gPingSecs);
+			gFormatter = influxdb_post_init (NULL, 0, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, 0);
+			if (!gFormatter) exit(1);
+			if (!dryrun && influxdb_post_startThread(gClient) != 0) exit(1);
+		}
 	} else
 		LOGN(0,"no grafana host,token or pushid specified, grafana sender disabled");
 
-	rc = mqttReceiverInit (mClient->hostname, mClient->port, mqttTopic, mqttReceiverClientID);
-	if (!rc) {
+	if (!mqttSingleConnection) rc = mqttReceiverInit (mClient->hostname, mClient->port, mqttTopic, mqttReceiverClientID);
+	if (!mqttSingleConnection && !rc) {
 		EPRINTFN("failed to init mqttReceiver for %s:%d, topic: %s, will retry later",mClient->hostname,mClient->port,mqttTopic);
 		mqttReceiverConnectionLost++;
 	}
@@ -553,9 +1798,10 @@ int main(int argc, char *argv[]) {
 	int loopCount = 0;
 	now = time(NULL);
 	nextSendTime = now + queryIntervalSecs;
+	nextStatsTime = now + statsIntervalSecs;
 	if (verbose || dryrun) {
-		LOG (0,"Influx next write time: %s",ctime(&nextSendTime));
-		LOGN(0,"                   now: %s (interval: %d)",strtok(ctime(&now),"\n"),queryIntervalSecs);
+		LOG (0,"Influx max age of pending data: %d seconds, max points: %d, max bytes: %d, min interval: %d seconds",queryIntervalSecs,influxMaxPoints,influxMaxBytes,influxMinIntervalSecs);
+		LOGN(0,"                   now: %s",strtok(ctime(&now),"\n"));
 	}
 
 	while (!terminated) {
@@ -563,37 +1809,59 @@ int main(int argc, char *argv[]) {
 		loopCount++;
 		//if (dryrun) printf("- %d -----------------------------------------------------------------------\n",loopCount);
 		mqtt_pub_yield (mClient); 			// for mqtt ping, sleeps for 100ms if no mqqt specified
-		if (gClient) influxdb_post_http(gClient);	// for websocket ping
 
 
-		if (iClient) {		// influx
-			if (time(0) >= nextSendTime) {
-				influxdb_post_freeBuffer(iClient);
+		if (iFormatter) {		// influx
+			now = time(NULL);
+			mqttDataLock();
+			derivedUpdate();
+			flushReason = influxdb_flush_check(&influxCollectPolicy, influxPending.points, influxPending.bytes, influxPending.oldest, now);
+			if (flushReason != influx_flush_none) {
+				influxdb_post_resetBuffer(iFormatter);
 				influxTimestamp = influxdb_getTimestamp();
-				mqttDataLock();
 				dataRead_t *dataRead = mqttDataRead;
+				int accelPoints = 0;
 				while(dataRead) {
-					influxAppendData (iClient, dataRead, influxTimestamp);
+					influxAppendData (iFormatter, dataRead, influxTimestamp);
+					if (dataRead->accel.count) {
+						int n = influxAppendAccel (iFormatter, dataRead);
+						if (n > 0) accelPoints += n;
+					}
 					dataRead = dataRead->next;
 				}
-				mqttDataUnlock();
-				if (dryrun) {
-					if (iClient->influxBufLen) printf("\nDryrun: would send to influxdb:\n%s\n",iClient->influxBuf);
+				flushed = influxPending;
+				flushed.points += accelPoints;
+				memset(&influxPending,0,sizeof(influxPending));
+			}
+			mqttDataUnlock();
+			if (flushReason != influx_flush_none) {
+				VPRINTFN(1,"influx write (%s): %d points, %zu bytes",influxdb_flushReasonStr(flushReason),flushed.points,iFormatter->influxBufUsed);
+				influxdb_flush_done(&influxCollectPolicy, flushReason, now);
+			}
+			if (dryrun) {
+				if (flushReason != influx_flush_none || now >= nextSendTime) {
+					if (iFormatter->influxBufUsed) printf("\nDryrun: would send to influxdb:\n%s\n",iFormatter->influxBuf);
 					else printf("Dryrun: nothing to be send to influxdb\n");
-					influxdb_post_freeBuffer(iClient);
+					influxdb_post_resetBuffer(iFormatter);
                     dryrun--;
                     if (!dryrun) terminated++;
-				} else {
-					//printf("Posting to influxdb, len:%ld\n",iClient->influxBufLen);
-					if (iClient->influxBufLen) {
-						rc = influxdb_post_http_line(iClient);
-						influxdb_post_freeBuffer(iClient);
-						if (rc != 0) {
-							LOGN(0,"Error: influxdb_post_http_line failed with rc %d",rc);
-						}
-					}
+					nextSendTime = now + queryIntervalSecs;
+				}
+			} else {
+				// queued to all targets, posted by the sender threads
+				if (flushReason != influx_flush_none && iFormatter->influxBufUsed) {
+					influx_sharedBuf_t *buf = influxdb_sharedBuf_detach(iFormatter, flushed.points);
+					for (influxTarget_t *t = influxTargets; t; t = t->next)
+						if (!t->noRaw) influxdb_post_enqueue(t->c, buf);
+					influxdb_sharedBuf_release(buf);
 				}
-				nextSendTime = time(NULL) + queryIntervalSecs;
+				influxdb_post_resetBuffer(iFormatter);
+			}
+			if (influxTiers) {
+				mqttDataLock();
+				derivedUpdate();
+				influxTiersWrite(now);
+				mqttDataUnlock();
 			}
 		} else
             if (dryrun) {
@@ -601,50 +1869,80 @@ int main(int argc, char *argv[]) {
                 if (!dryrun) terminated++;
             }
 
-		int numChanged = 0;
-		if ((mClient && mqttprefix) || gClient) {		// mqtt
+		if (statsIntervalSecs && time(NULL) >= nextStatsTime) {
+			logStatistics();
+			nextStatsTime = time(NULL) + statsIntervalSecs;
+		}
+
+		unsigned long numChanged = 0;
+		if ((mClient && (mqttprefix || mqttCborPrefix)) || gClient) {		// mqtt
 			mqttDataLock();
+			derivedUpdate();
+			nowMs = timerWheel_nowMs();
+			numChanged = pubNumPublished;
 			dr = mqttDataRead;
 			while(dr) {
-				if (dr->updated) {
+				// a resend already scheduled is published by the timer
+				if (dr->updated || (dr->pubResend && !timerWheel_isScheduled(&dr->pubTimer))) {
 					//if (dryrun && !dryRunMsg) printf("Dryrun: would send to mqtt:\n");
+					if (dr->updated) pubNumUpdates++;
 					dr->updated = 0;
-					numChanged++;
-					if (mClient && mqttprefix) mqttSendData (dr,dryrun);
+					if (dr->pubIntervalMs < 0) pubIntervalResolve(dr);
+					// changes within the deadband are not republished until deadbandmaxsilence has elapsed
+					if (dr->lastPublishMs && dr->deadband->enabled && !dr->pubResend && !timerWheel_isScheduled(&dr->pubTimer)
+						&& !deadbandExceeded(dr->deadband,&dr->dataCurr,&dr->dataPublish)) {
+						if (!deadbandMaxSilenceSecs || nowMs < dr->lastPublishMs + (uint64_t)deadbandMaxSilenceSecs * 1000) {
+							pubNumSuppressed++;
+							dr = dr->next;
+							continue;
+						}
+						pubNumForced++;
+					}
+					// publish now or once the interval has elapsed with the latest values at that time
+					if (timerWheel_isScheduled(&dr->pubTimer)) {
+						pubNumCoalesced++;
+						dr->pubPending = PUB_PENDING_ALL;
+					}
+					else if (!dr->lastPublishMs || nowMs >= dr->lastPublishMs + dr->pubIntervalMs) {
+						// one tick behind the retries rescheduled by the following timerWheel_advance
+						if (pubNumDeferred) timerWheel_add(&pubWheel,&dr->pubTimer,nowMs + PUB_RETRY_MS + PUB_WHEEL_TICK_MS);
+						else publishDevice(dr,nowMs);
+					} else timerWheel_add(&pubWheel,&dr->pubTimer,dr->lastPublishMs + dr->pubIntervalMs);
 				}
 				dr = dr->next;
 			}
-			if (numChanged || grafanaWriteCounter >= GrafanaFourceCount) {
-				GrafanaWriteData(gClient);	// always write to grafana to avoid internal grafana timeout if live data
-				grafanaWriteCounter = 0;
-			} else {
-				grafanaWriteCounter++;
+			timerWheel_advance(&pubWheel,nowMs,pubTimerExpired,&nowMs);
+			if (mqttBulkLen) mqttBulkFlush(dryrun);
+			numChanged = pubNumPublished - numChanged;
+			now = time(NULL);
+			if (gClient && (numChanged || grafanaFull || now >= nextGrafanaRefresh)) {
+				// regular full refresh to avoid internal grafana timeout of live data
+				if (now >= nextGrafanaRefresh) {
+					grafanaFull = 1;
+					nextGrafanaRefresh = now + gRefreshSecs;
+				}
+				rc = GrafanaWriteData(gClient, grafanaFull);
+				grafanaFull = (rc != 0);	// values may be lost, post all on the next try
 			}
 			mqttDataUnlock();
 		}
 
 		msleep(200);
-		if (gClient) influxdb_post_http(iClient);	// for websocket ping
 
 
 		if (isFirstQuery) isFirstQuery--;
 
-		if (mqttReceiverConnectionLost) {
+		// reconnect attempts are scheduled, the main loop keeps publishing and posting meanwhile
+		if (mqttReceiverConnectionLost && time(NULL) >= nextReceiverConnect) {
 			VPRINTFN(1,"MQTT connection lost, will try to reconnect");
 		    if (!mqttReceiver_isConnected()) {
 				mqttReceiverDone(mqttTopic);
-				msleep(1500);
 				rc = mqttReceiverInit (mClient->hostname, mClient->port, mqttTopic, ME "-SUB");
 				if (rc) {
 					mqttReceiverConnectionLost = 0;
 					LOGN(0,"mqtt receiver reconnected");
-				} else {
-					rc = 150;		// wait 15 seconds before the next connect attempt
-					while (rc && !terminated) {
-						rc--;
-						msleep(100);
-					}
-				}
+				} else
+					nextReceiverConnect = time(NULL) + RECEIVER_RECONNECT_SECS;
 			} else {
 			  EPRINTFN("Got disconnect callback but client is connected, will not perform reconnect");
 			  mqttReceiverConnectionLost = 0;
@@ -655,18 +1953,72 @@ int main(int argc, char *argv[]) {
 	}
 
 	VPRINTFN(1,"end of mainloop");
+	if (statsIntervalSecs || verbose) logStatistics();
 
-	mqttReceiverDone(mqttTopic);
+	if (!mqttSingleConnection) mqttReceiverDone(mqttTopic);
 
 	if (mClient) mqtt_pub_free(mClient);
-	influxdb_post_free(iClient);
+	while (influxTargets) {
+		influxTarget_t *t = influxTargets;
+		influxTargets = t->next;
+		influxdb_post_free(t->c);		// posts pending data if possible
+		free(t->spec);
+		free(t);
+	}
+	influxdb_post_free(iFormatter);
+	influxdb_post_free(gClient);
+	influxdb_post_free(gFormatter);
 
     free(configFileName);
 	free(mqttprefix);
+	free(mqttCborPrefix);
+	free(mqttPersistenceDir);
 
 	free(influxMeasurement);
 	free(influxTagName);
+	free(influxPrecision);
+	free(influxFieldsSpec);
+	free(derivedSpec);
+	free(spikeFilterSpec);
+	free(accelMeasurement);
+	free(accelFieldsSpec);
+	free(derivedBatch.dr);
+	free(derivedBatch.temp);
+	free(derivedBatch.humidity);
+	for (int m=0;m<derived_numMetrics;m++) free(derivedBatch.values[m]);
+	influxFieldsFree(influxFields);
+	while (influxTiers) {
+		influxTier_t *tier = influxTiers;
+		influxTiers = tier->next;
+		influxdb_post_free(tier->formatter);
+		influxFieldsFree(tier->fields);
+		free(tier->targets);
+		free(tier->measurement);
+		free(tier->name);
+		free(tier->spec);
+		free(tier);
+	}
+	free(mqttBuf);
 	free(mqttTopic);
+	free(mqttBulk);
+	mqtt_topic_free(&mqttBulkTopic);
+	free(mqttBulkBuf);
+	free(mqttBulkDevices);
+	timerWheel_free(&pubWheel);
+	while (deadbandFors) {
+		deadbandFor_t *df = deadbandFors;
+		deadbandFors = df->next;
+		free(df->pattern);
+		free(df->spec);
+		free(df);
+	}
+	free(deadbandSpec);
+	while (pubIntervals) {
+		pubInterval_t *pi = pubIntervals;
+		pubIntervals = pi->next;
+		free(pi->pattern);
+		free(pi);
+	}
 
 	LOGN(0,"terminated");
 
@@ -0,0 +1,38 @@
+#include "spikefilter.h"
+#include <math.h>
+
+#define MAD_TO_SIGMA 1.4826
+
+// insertion sort, n is small
+static double median(double *a, int n) {
+	int i,j;
+	double t;
+
+	for (i=1;i<n;i++) {
+		t = a[i];
+		for (j=i;j>0 && a[j-1]>t;j--) a[j] = a[j-1];
+		a[j] = t;
+	}
+	return n & 1 ? a[n/2] : (a[n/2-1] + a[n/2]) / 2;
+}
+
+int spikeFilter_add(spikeWindow_t *w, int n, double v, double threshold, double minDeviation) {
+	double sorted[SPIKEFILTER_MAX_WINDOW];
+	double med,mad,band;
+	int i;
+
+	if (n > SPIKEFILTER_MAX_WINDOW) n = SPIKEFILTER_MAX_WINDOW;
+	if (n < 1) return 0;
+	w->v[w->next] = v;
+	w->next = (w->next + 1) % n;
+	if (w->count < n) w->count++;
+	if (w->count < 3) return 0;
+
+	for (i=0;i<w->count;i++) sorted[i] = w->v[i];
+	med = median(sorted,w->count);
+	for (i=0;i<w->count;i++) sorted[i] = fabs(w->v[i] - med);
+	mad = median(sorted,w->count);
+	band = threshold * MAD_TO_SIGMA * mad;
+	if (band < minDeviation) band = minDeviation;
+	return fabs(v - med) > band;
+}
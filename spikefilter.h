@@ -0,0 +1,35 @@
+#ifndef SPIKEFILTER_H_INCLUDED
+#define SPIKEFILTER_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/*
+  Hampel filter over the last n samples of a value (median of n). A sample
+  is an outlier if it differs from the median of the window by more than
+  threshold * 1.4826 * MAD (median absolute deviation, scaled to the
+  standard deviation of normally distributed values), but at least by
+  minDeviation. Outliers are added to the window as well, so a lasting step
+  is accepted once it holds the majority. Time and memory per sample are
+  bounded by SPIKEFILTER_MAX_WINDOW.
+*/
+
+#define SPIKEFILTER_MAX_WINDOW 15
+
+typedef struct {
+	double v[SPIKEFILTER_MAX_WINDOW];
+	uint8_t next;               // ring position of the next sample
+	uint8_t count;
+} spikeWindow_t;
+
+// adds v to the window of size n, returns 1 if v is an outlier, samples are accepted until the window holds 3
+int spikeFilter_add(spikeWindow_t *w, int n, double v, double threshold, double minDeviation);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SPIKEFILTER_H_INCLUDED
@@ -0,0 +1,91 @@
+#include "timerwheel.h"
+#include <stdlib.h>
+#include <time.h>
+
+int timerWheel_init(timerWheel_t *w, int numSlots, int tickMs, uint64_t nowMs) {
+	int i;
+
+	if (numSlots < 1 || tickMs < 1) return -1;
+	w->slots = calloc(numSlots, sizeof(timerWheelNode_t));
+	if (!w->slots) return -1;
+	for (i=0;i<numSlots;i++) w->slots[i].next = w->slots[i].prev = &w->slots[i];
+	w->numSlots = numSlots;
+	w->tickMs = tickMs;
+	w->currTick = nowMs / tickMs;
+	w->numScheduled = 0;
+	return 0;
+}
+
+void timerWheel_free(timerWheel_t *w) {
+	free(w->slots);
+	w->slots = NULL;
+}
+
+int timerWheel_isScheduled(const timerWheelNode_t *node) {
+	return node->next != NULL;
+}
+
+void timerWheel_remove(timerWheel_t *w, timerWheelNode_t *node) {
+	if (!node->next) return;
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+	node->next = node->prev = NULL;
+	w->numScheduled--;
+}
+
+void timerWheel_add(timerWheel_t *w, timerWheelNode_t *node, uint64_t expiresMs) {
+	timerWheelNode_t *head;
+	uint64_t tick;
+
+	timerWheel_remove(w, node);
+	node->expiresMs = expiresMs;
+	tick = (expiresMs + w->tickMs - 1) / w->tickMs;    // never expire early
+	if (tick < w->currTick) tick = w->currTick;     // already expired, process with the next advance
+	head = &w->slots[tick % w->numSlots];
+	node->next = head;
+	node->prev = head->prev;
+	head->prev->next = node;
+	head->prev = node;
+	w->numScheduled++;
+}
+
+int timerWheel_advance(timerWheel_t *w, uint64_t nowMs, timerWheelCallback_t cb, void *ctx) {
+	uint64_t nowTick = nowMs / w->tickMs;
+	timerWheelNode_t *head, *node, *next, *expired = NULL, *expiredLast = NULL;
+	int numExpired = 0;
+
+	// nothing to do for slots without timers, skip a full revolution at most
+	if (w->numScheduled == 0) {
+		w->currTick = nowTick + 1;
+		return 0;
+	}
+	if (nowTick >= w->currTick + w->numSlots) w->currTick = nowTick - w->numSlots + 1;
+	while (w->currTick <= nowTick) {
+		head = &w->slots[w->currTick % w->numSlots];
+		for (node = head->next; node != head; node = next) {
+			next = node->next;
+			if ((node->expiresMs + w->tickMs - 1) / w->tickMs > w->currTick) continue;   // later revolution
+			timerWheel_remove(w, node);
+			node->prev = NULL;                      // collect first, cb may add timers
+			if (expiredLast) expiredLast->prev = node;  // in order of expiry
+			else expired = node;
+			expiredLast = node;
+		}
+		w->currTick++;
+	}
+	while (expired) {
+		node = expired;
+		expired = node->prev;
+		node->prev = NULL;
+		numExpired++;
+		cb(node, ctx);
+	}
+	return numExpired;
+}
+
+uint64_t timerWheel_nowMs() {
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
+}
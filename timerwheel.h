@@ -0,0 +1,52 @@
+#ifndef TIMERWHEEL_H_INCLUDED
+#define TIMERWHEEL_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/*
+  Hashed timer wheel, adding, removing and expiring a timer is O(1).
+  Timers beyond one revolution of the wheel stay in their slot until
+  their expire time is reached.
+  Nodes are embedded in the caller's data, no allocations are done
+  after timerWheel_init.
+*/
+
+typedef struct timerWheelNode_t timerWheelNode_t;
+struct timerWheelNode_t {
+	timerWheelNode_t *next,*prev;   // NULL if not scheduled
+	uint64_t expiresMs;
+	void *data;
+};
+
+typedef void (*timerWheelCallback_t)(timerWheelNode_t *node, void *ctx);
+
+typedef struct {
+	int numSlots;
+	int tickMs;
+	uint64_t currTick;              // next tick to be processed
+	timerWheelNode_t *slots;        // list heads
+	int numScheduled;
+} timerWheel_t;
+
+// returns 0 on success
+int timerWheel_init(timerWheel_t *w, int numSlots, int tickMs, uint64_t nowMs);
+void timerWheel_free(timerWheel_t *w);
+// reschedules the node if already scheduled
+void timerWheel_add(timerWheel_t *w, timerWheelNode_t *node, uint64_t expiresMs);
+void timerWheel_remove(timerWheel_t *w, timerWheelNode_t *node);
+int timerWheel_isScheduled(const timerWheelNode_t *node);
+// calls cb for all timers expired up to nowMs, cb may add or remove timers
+int timerWheel_advance(timerWheel_t *w, uint64_t nowMs, timerWheelCallback_t cb, void *ctx);
+
+// monotonic time in milliseconds
+uint64_t timerWheel_nowMs();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TIMERWHEEL_H_INCLUDED